@@ -3,6 +3,7 @@
 #include <SDL2/SDL.h>
 #undef main
 #include <phoenix/phoenix.hpp>
+#include <nall/unzip.hpp>
 #define SDL_DYNLIB
 #include <mupen/m64p_common.h>
 #include <mupen/m64p_frontend.h>
@@ -10,6 +11,11 @@
 #include <mupen/m64p_debugger.h>
 
 #include <atomic>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <deque>
 
 using namespace nall;
 using namespace phoenix;
@@ -28,22 +34,18 @@ namespace API
 	ptr_DebugStep DebugStep;
 	ptr_DebugMemGetPointer DebugMemGetPointer;
     ptr_DebugMemRead32 DebugMemRead32;
+    ptr_DebugMemWrite8 DebugMemWrite8;
+    ptr_DebugMemWrite32 DebugMemWrite32;
+    ptr_DebugBreakpointCommand DebugBreakpointCommand;
+    ptr_DebugGetCPUDataPtr DebugGetCPUDataPtr;
+    ptr_DebugDecodeOp DebugDecodeOp;
+    ptr_DebugMemGetMemInfo DebugMemGetMemInfo;
+    ptr_DebugMemGetRecompInfo DebugMemGetRecompInfo;
     
     void * Video;
-    ptr_PluginGetVersion VideoVersion; 
-    ptr_PluginStartup VideoStartup; 
-    
     void * Audio;
-    ptr_PluginGetVersion AudioVersion; 
-    ptr_PluginStartup AudioStartup; 
-    
     void * RSP;
-    ptr_PluginGetVersion RSPVersion; 
-    ptr_PluginStartup RSPStartup; 
-    
     void * Input;
-    ptr_PluginGetVersion InputVersion; 
-    ptr_PluginStartup InputStartup;
     
 	template<typename funcptr>
 	bool LoadFunction ( funcptr * function, const char * funcname, void * object )
@@ -72,365 +74,5200 @@ char working_dir[PATH_MAX];
 string romname;
 std::atomic<SDL_Thread *> corethread;
 std::atomic<SDL_Thread *> romthread;
+std::atomic<bool> romloading; // set before RomScript is spawned, so a quick load can't clear it early
 
-void debug (void * ctx, int level, const char * msg)
+namespace Memory
 {
-    if ( level != M64MSG_VERBOSE )
-        std::cout << (const char *)ctx << ": " << msg << "\n";
+    const Uint32 rdramsize = 0x800000;
+    
+    // Offset into RDRAM for a KSEG0/KSEG1 address, or rdramsize if it's elsewhere (TLB, MMIO, ROM...)
+    Uint32 rdramoffset ( Uint32 address )
+    {
+        if(address < 0x80000000 or address >= 0xC0000000)
+            return rdramsize;
+        address &= 0x1FFFFFFF;
+        return address < rdramsize ? address : rdramsize;
+    }
+    
+    // Reads count words starting at a word-aligned address. RDRAM is copied straight out of the core's
+    // buffer (which holds native-endian words, so no swapping is needed); everything else goes word by
+    // word through DebugMemRead32 so MMIO reads keep their side effects and translation.
+    void read32 ( Uint32 address, Uint32 * words, unsigned count )
+    {
+        Uint32 * rdram = (Uint32 *)API::DebugMemGetPointer(M64P_DBG_PTR_RDRAM);
+        unsigned i = 0;
+        while(i < count)
+        {
+            Uint32 current = address+i*4;
+            Uint32 offset = rdramoffset(current);
+            if(rdram and offset < rdramsize)
+            {
+                unsigned run = min(count-i, (rdramsize-offset)/4);
+                memcpy(words+i, rdram+offset/4, run*4);
+                i += run;
+            }
+            else
+                words[i++] = API::DebugMemRead32(current);
+        }
+    }
 }
 
-struct MainWindow;
-
-struct MemoryWindow : Window
-{
-	FixedLayout layout;
-	TextEdit display;
-	LineEdit address;
-	
-	bool editing;
-	Uint32 inputnum;
-	MemoryWindow();
-};
-
-struct Debugger : Window
-{
-    FixedLayout layout;
-    Button btn_memory;
-    Button btn_registers;
-    Button btn_search;
-    Button btn_commands;
-	bool visible;
-    MainWindow * parent;
-    Debugger(MainWindow * arg_parent);
-	MemoryWindow win_memory;
-};
-
-struct Options : Window
-{
-    FixedLayout layout;
-    Button btn_apply;
-    MainWindow * parent;
-    Options(MainWindow * arg_parent);
-    unsigned short config_height;
-    unsigned short config_width;
-};
-
-struct MainWindow : Window
+string disassemble ( Uint32 address )
 {
-    FixedLayout layout;
-    Button btn_load;
-    Button btn_options;
-    Button btn_save;
-    Button btn_restore;
-    Button btn_pauser;
-    image img_pause;
-    image img_play;
-    Options * win_options;
-	Debugger * win_debugger;
-    bool paused;
-    BrowserWindow browser;
-    MainWindow();
-    nall::function<void()> do_play;
-    nall::function<void()> do_pause;
-    nall::function<void()> do_loadrom;
-    nall::function<void()> do_stop;
-};
+	char op[64], args[64];
+	op[0] = args[0] = 0;
+	API::DebugDecodeOp(API::DebugMemRead32(address), op, args, address);
+	return {op, " ", args};
+}
 
-MemoryWindow::MemoryWindow()
+// Core lifecycle: Idle -> Loading -> Attached -> Running/Paused -> Stopping -> Idle. Threads block on
+// the condition variable for the state they need; Running/Paused/Stopping come from the core's own
+// state callback, so nothing polls the core.
+struct CoreController
 {
-	setTitle("Memory");
+	enum class State : unsigned { Idle, Loading, Attached, Running, Paused, Stopping };
+	SDL_mutex * mutex;
+	SDL_cond * changed;
+	State state;
+	bool romready;
+	bool romloaded;
+	Uint64 selected; // when the ROM was picked, for the ROM-select-to-first-frame time
+	std::atomic<bool> awaitingframe;
 	
-	auto update = [this]()
+	CoreController() : mutex(NULL), changed(NULL), state(State::Idle), romready(false), romloaded(false), selected(0), awaitingframe(false) {}
+	
+	static const char * name(State state)
 	{
-		auto size = sizeof(Uint32);
-		if(this->address.text().length() <= 8 or (this->address.text().beginsWith("0x") and this->address.text().length() <= 10))
-			inputnum = hex(this->address.text());
-		else
+		switch(state)
 		{
-			puts("UI: Invalid address input in memory viewer.");
-			return;
+		case State::Idle: return "Idle";
+		case State::Loading: return "Loading";
+		case State::Attached: return "Attached";
+		case State::Running: return "Running";
+		case State::Paused: return "Paused";
+		case State::Stopping: return "Stopping";
 		}
-		inputnum = inputnum/size*size;
-		
-		auto numwide = 4;
-		auto sizewide = numwide*size;
-		auto sizetall = 0x30;
-		
-		nall::string displaytext("");
-		
-		Uint32 buffer;
-		for (auto j = 0; j < sizetall*sizewide; j += sizewide)
+		return "?";
+	}
+	
+	void initialize()
+	{
+		mutex = SDL_CreateMutex();
+		changed = SDL_CreateCond();
+	}
+	
+	void set(State next)
+	{
+		SDL_LockMutex(mutex);
+		if(next == State::Loading)
+			romready = romloaded = false;
+		if(state != next)
+			std::cout << "UI: Core state " << name(state) << " -> " << name(next) << "\n";
+		state = next;
+		SDL_CondBroadcast(changed);
+		SDL_UnlockMutex(mutex);
+	}
+	
+	State get()
+	{
+		SDL_LockMutex(mutex);
+		State current = state;
+		SDL_UnlockMutex(mutex);
+		return current;
+	}
+	
+	void rom(bool loaded)
+	{
+		SDL_LockMutex(mutex);
+		romready = true;
+		romloaded = loaded;
+		if(loaded)
+		{
+			selected = SDL_GetPerformanceCounter();
+			awaitingframe = true;
+		}
+		SDL_CondBroadcast(changed);
+		SDL_UnlockMutex(mutex);
+	}
+	
+	// blocks until the ROM bytes are in memory (or loading failed)
+	bool waitrom()
+	{
+		SDL_LockMutex(mutex);
+		while(!romready)
+			SDL_CondWait(changed, mutex);
+		bool loaded = romloaded;
+		SDL_UnlockMutex(mutex);
+		return loaded;
+	}
+	
+	// blocks until the state is one of the wanted ones; false on timeout (0: wait forever)
+	template<typename... States> bool waitfor(Uint32 timeout, States... wanted)
+	{
+		State list[] = {wanted...};
+		Uint32 start = SDL_GetTicks();
+		SDL_LockMutex(mutex);
+		while(true)
 		{
-			displaytext.append("0x", hex<8, '0'>(inputnum+j), ": ");
-			for (auto i = 0; i < sizewide; i += size)
+			for (auto candidate : list)
 			{
-				displaytext.append(hex<8, '0'>(API::DebugMemRead32(inputnum+i+j)));
-				if(i+size < sizewide)
-					displaytext.append(" ");
+				if(state == candidate)
+				{
+					SDL_UnlockMutex(mutex);
+					return true;
+				}
 			}
-			if(j+sizewide < sizetall*sizewide)
-				displaytext.append("\n");
+			Uint32 elapsed = SDL_GetTicks()-start;
+			if(timeout and elapsed >= timeout)
+				break;
+			if(timeout)
+				SDL_CondWaitTimeout(changed, mutex, timeout-elapsed);
+			else
+				SDL_CondWait(changed, mutex);
 		}
-		display.setText(displaytext);
-		ret:
+		SDL_UnlockMutex(mutex);
+		return false;
+	}
+	
+	// core thread
+	void frame()
+	{
+		if(!awaitingframe.exchange(false))
+			return;
+		double ms = (double)(SDL_GetPerformanceCounter()-selected)*1000/SDL_GetPerformanceFrequency();
+		std::cout << "UI: ROM select to first frame: " << ms << "ms\n";
+	}
+} controller;
+
+// Who has a savestate job queued in the core. The core keeps only one at a time and its completion
+// callbacks don't say whose it was, so a job is claimed here first and released when it completes.
+enum class StateJob : unsigned { None, Rewind, Slot };
+std::atomic<StateJob> statejob(StateJob::None);
+
+bool claimstate (StateJob job)
+{
+	StateJob none = StateJob::None;
+	return statejob.compare_exchange_strong(none, job);
+}
+
+void statecomplete (m64p_core_param param, int value);
+void abandonstates ();
+
+void corestate (void *, m64p_core_param param, int value)
+{
+	if(param == M64CORE_STATE_SAVECOMPLETE or param == M64CORE_STATE_LOADCOMPLETE)
+		statecomplete(param, value);
+	if(param != M64CORE_EMU_STATE)
 		return;
+	if(value == M64EMU_RUNNING)
+		controller.set(CoreController::State::Running);
+	else if(value == M64EMU_PAUSED)
+		controller.set(CoreController::State::Paused);
+	else if(value == M64EMU_STOPPED and controller.get() != CoreController::State::Idle)
+		controller.set(CoreController::State::Stopping);
+}
+
+// Widget changes requested from SDL threads. Producers push closures onto a lock-free intrusive MPSC
+// list (Vyukov's); the GUI thread drains it from a timer. Posts that share a key replace each other
+// within one drain, so a burst of status changes turns into a single update.
+struct UIQueue
+{
+	enum class Key : unsigned { None, RunButtons, Debugger, Library, Savestates };
+	struct Node
+	{
+		std::atomic<Node *> next;
+		Key key;
+		nall::function<void()> action;
 	};
-	auto font = Font::monospace(10);
-	display.setFont(font);
-	address.setFont(font);
-	address.setText("0x80000000");
-	address.onChange = update;
-	
-	auto prefixsize = Font::size(font, "0x");
-	auto delimsize = Font::size(font, ": ");
-	auto wordsize = Font::size(font, "12345678");
-	auto chunksize = Font::size(font, "12345678 12345678 12345678 12345678");
+	std::atomic<Node *> head;
+	Node * tail; // GUI thread only
+	Node stub;
 	
-	auto viewwidth = prefixsize.width+wordsize.width+delimsize.width+chunksize.width+6+24;
-	auto entrywidth = wordsize.width+prefixsize.width+6;
-	auto entryheight = wordsize.height+6;
-	auto viewheight = wordsize.height*0x30+6;
+	UIQueue() : head(&stub), tail(&stub)
+	{
+		stub.next = NULL;
+	}
 	
-	setGeometry({64, 256, viewwidth+20, entryheight + 30 + viewheight});
+	void push(Node * node)
+	{
+		node->next.store(NULL, std::memory_order_relaxed);
+		Node * previous = head.exchange(node, std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
 	
-	layout.append(address, Geometry{10, 10, entrywidth, entryheight});
-	layout.append(display, Geometry{10, entryheight+20, viewwidth, viewheight});
-	append(layout);
+	// any thread; never blocks
+	void post(Key key, const nall::function<void()> & action)
+	{
+		Node * node = new Node;
+		node->key = key;
+		node->action = action;
+		push(node);
+	}
 	
+	Node * pop()
+	{
+		Node * current = tail;
+		Node * next = current->next.load(std::memory_order_acquire);
+		if(current == &stub)
+		{
+			if(!next)
+				return NULL;
+			tail = next;
+			current = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if(next)
+		{
+			tail = next;
+			return current;
+		}
+		// a producer is between its exchange and its link; pick it up on the next drain
+		if(current != head.load(std::memory_order_acquire))
+			return NULL;
+		push(&stub);
+		next = current->next.load(std::memory_order_acquire);
+		if(next)
+		{
+			tail = next;
+			return current;
+		}
+		return NULL;
+	}
 	
-	setVisible(false);
+	// GUI thread
+	void drain()
+	{
+		std::vector<Node *> batch;
+		while(Node * node = pop())
+			batch.push_back(node);
+		for (unsigned i = 0; i < batch.size(); i++)
+		{
+			bool superseded = false;
+			for (unsigned j = i+1; j < batch.size() and batch[i]->key != Key::None and !superseded; j++)
+				superseded = batch[j]->key == batch[i]->key;
+			if(!superseded)
+				batch[i]->action();
+			delete batch[i];
+		}
+	}
+} uiqueue;
+
+void debug (void * ctx, int level, const char * msg)
+{
+    if ( level != M64MSG_VERBOSE )
+        std::cout << (const char *)ctx << ": " << msg << "\n";
 }
 
-Options::Options(MainWindow * arg_parent)
+// length-prefixed strings for the small binary index files
+string readtext(file & input)
 {
-	setTitle("Options");
-    parent = arg_parent;
-    setGeometry({64, 256, 340, 500});
-    config_height = 960;
-    config_width = 720;
-    btn_apply.setText("Apply");
-    btn_apply.onActivate = [this]()
-    {
-        std::cout << "UI: Options: Applying options-- \n";
-        m64p_2d_size val = {this->config_height, this->config_width};
-        //std::cout << "UI: Options: Setting resolution to " << std::dec << this->config_height << " " << this->config_width << " (" << std::hex << val << ")\n";
-        auto err = API::CoreDoCommand(M64CMD_CORE_STATE_SET, M64CORE_VIDEO_SIZE, &val);
-        if(err != M64ERR_SUCCESS)
-            std::cout << "UI: Options: Core returned error on attempt to change video size: " << err << "\n";
-        
-    };
-    layout.append(btn_apply, Geometry{10, 10, 40, 24});
-    append(layout);
-    setResizable(false);
-    setVisible(false); // must be after setResizable()
-    onClose = [this]()
-    {
-        this->setVisible(!this->visible());
-    };
+	unsigned length = input.readl(2);
+	std::vector<char> buffer(length+1, 0);
+	input.read((uint8_t *)buffer.data(), length);
+	return buffer.data();
 }
 
-Debugger::Debugger(MainWindow * arg_parent)
+void writetext(file & output, const string & text)
 {
-	setTitle("Debugger");
-    parent = arg_parent;
-    setGeometry({64, 64, 20+128+4, 10+24+4+24+10});
-	btn_memory.setText("Memory");
-	btn_memory.onActivate = [this]()
+	output.writel(text.length(), 2);
+	output.write((const uint8_t *)(const char *)text, text.length());
+}
+
+// nall's append mode opens with "wb+" and truncates, so this opens for modify and seeks to the end
+bool openappend(file & output, const string & filename)
+{
+	if(!file::exists(filename) and !file::write(filename, (const uint8_t *)"", 0))
+		return false;
+	if(!output.open(filename, file::mode::modify))
+		return false;
+	output.seek(output.size());
+	return true;
+}
+
+// Plugin registry. Libraries in the plugin folder are probed for PluginGetVersion on a small pool of
+// threads, and what they report is cached in plugins.idx by name, mtime and size so later launches
+// don't open them at all. The chosen plugin of each type is only loaded and started when first needed:
+// in the background once the window is up, or by the boot thread if a ROM gets there first.
+struct Plugins
+{
+	struct Info
 	{
-		//this->btn_memory.setVisible(!this->btn_memory.visible());
-        this->win_memory.setVisible(true);
+		string path;
+		uint64_t mtime;
+		uint64_t size;
+		bool valid;
+		m64p_plugin_type type;
+		int version;
+		int apiversion;
+		string name;
 	};
-	btn_registers.setText("Registers");
-	btn_registers.onActivate = [this]()
+	struct Slot
 	{
-		//this->btn_registers.setVisible(!this->btn_registers.visible());
+		const char * label;
+		m64p_plugin_type type;
+		const char * fallback; // preferred when nothing else was asked for
+		void ** handle;
+		string path;
+		ptr_PluginStartup startup;
 	};
-	btn_search.setText("Search");
-	btn_search.onActivate = [this]()
+	static const unsigned threads = 4;
+	
+	Slot slots[4]; // in the order the core wants them attached
+	std::vector<Info> found;
+	std::vector<unsigned> probing;
+	std::atomic<unsigned> next;
+	void * core;
+	SDL_mutex * lock;
+	bool started;
+	bool failed;
+	
+	Plugins() : next(0), core(NULL), lock(NULL), started(false), failed(false)
 	{
-		//this->btn_search.setVisible(!this->btn_search.visible());
-	};
-	btn_commands.setText("Commands");
-	btn_commands.onActivate = [this]()
+		slots[0] = {"Video", M64PLUGIN_GFX,   "mupen64plus-video-glide64mk2.dll", &API::Video, "", NULL};
+		slots[1] = {"Audio", M64PLUGIN_AUDIO, "mupen64plus-audio-sdl.dll",        &API::Audio, "", NULL};
+		slots[2] = {"Input", M64PLUGIN_INPUT, "mupen64plus-Input-sdl.dll",        &API::Input, "", NULL};
+		slots[3] = {"RSP",   M64PLUGIN_RSP,   "mupen64plus-rsp-hle.dll",          &API::RSP,   "", NULL};
+	}
+	
+	static void probe(Info & info)
 	{
-		//this->btn_commands.setVisible(!this->btn_commands.visible());
-	};
+		info.valid = false;
+		void * object = SDL_LoadObject(info.path);
+		if(!object)
+			return;
+		auto getversion = (ptr_PluginGetVersion)SDL_LoadFunction(object, "PluginGetVersion");
+		const char * name = NULL;
+		if(getversion and getversion(&info.type, &info.version, &info.apiversion, &name, NULL) == M64ERR_SUCCESS)
+		{
+			info.valid = true;
+			info.name = name ? name : "";
+		}
+		SDL_UnloadObject(object);
+	}
 	
-    layout.append(btn_memory,    Geometry{10     , 10     , 64-2, 24});
-    layout.append(btn_registers, Geometry{10+64+2, 10     , 64-2, 24});
-    layout.append(btn_search,    Geometry{10     , 10+24+4, 64-2, 24});
-    layout.append(btn_commands,  Geometry{10+64+2, 10+24+4, 64-2, 24});
+	static int prober(void * ptr)
+	{
+		Plugins & self = *(Plugins *)ptr;
+		unsigned index;
+		while((index = self.next++) < self.probing.size())
+			probe(self.found[self.probing[index]]);
+		return 0;
+	}
 	
-    onClose = [this]()
+	// Lists folder (plus any explicitly named libraries), probing only what the cache doesn't know, and
+	// picks a plugin for every slot. video overrides the video slot's choice when it isn't empty.
+	bool discover(const string & folder, const string & video)
 	{
-		this->parent->win_debugger = NULL;
-	};
-    
-    append(layout);
-    setResizable(false);
-    setVisible(false); // must be after setResizable()
-};
-
-int bootscript( void * ptr )
-{
-    if(!ptr)
-    {
-        std::cout << "UI: Bad window in core boot.\n";
-        return 0;
-    }
-    MainWindow * mainwin = (MainWindow *)ptr;
-    
-    if(romthread)
-    {
-        std::cout << "UI: Waiting for rom...\n";
-        SDL_WaitThread(romthread, NULL); // safe to pass potential NULL (data race) to SDL_WaitThread
-        std::cout << "UI: ROM got: " << romname << "\n";
-    }
-    if(romname.equals(""))
-    {
-        std::cout << "UI: Bad ROM name, leaving boot script.";
-        corethread = NULL;
-        return 0;
-    }
-    m64p_error err = API::CoreDoCommand(M64CMD_ROM_OPEN, API::romsize, API::romdata);
-    if(err)
-    {
-        std::cout << "Error loading ROM: " << err;
-        corethread = NULL;
-        return 0;
-    }
-    std::cout << "UI: Did load ROM; attaching plugins.\n";
-    
-    m64p_plugin_type VideoType;
-    int VideoVersion;
-    const char * VideoName;
-    API::VideoVersion(&VideoType, &VideoVersion, NULL, &VideoName, NULL);
-    err = API::CoreAttachPlugin(VideoType, API::Video);
-    if(err != M64ERR_SUCCESS)
-    {
-        std::cout << "Video plugin errored while attaching: " << err;
-        corethread = NULL;
-        return 0;
-    }
-    
-    m64p_plugin_type AudioType;
-    int AudioVersion;
-    const char * AudioName;
-    API::AudioVersion(&AudioType, &AudioVersion, NULL, &AudioName, NULL);
-    err = API::CoreAttachPlugin(AudioType, API::Audio);
-    if(err != M64ERR_SUCCESS)
+		std::map<string, Info> cache;
+		load(cache);
+		
+		string base = folder;
+		if(!base.endsWith("/"))
+			base.append("/");
+		lstring names;
+		for (auto & name : directory::files(base, "mupen64plus-*.dll"))
+			names.append({base, name});
+		if(video != "" and !names.find(video))
+			names.append(video);
+		
+		found.clear();
+		probing.clear();
+		for (auto & path : names)
+		{
+			Info info;
+			info.path = path;
+			info.mtime = file::timestamp(path, file::time::modify);
+			info.size = file::size(path);
+			auto known = cache.find(path);
+			if(known != cache.end() and known->second.mtime == info.mtime and known->second.size == info.size)
+				info = known->second;
+			else
+				probing.push_back(found.size());
+			found.push_back(info);
+		}
+		
+		next = 0;
+		SDL_Thread * pool[threads];
+		unsigned count = min(threads, (unsigned)probing.size());
+		for (unsigned i = 0; i < count; i++)
+			pool[i] = SDL_CreateThread(prober, "PluginProbe", this);
+		for (unsigned i = 0; i < count; i++)
+			SDL_WaitThread(pool[i], NULL);
+		if(probing.size())
+			save();
+		
+		bool complete = true;
+		for (auto & slot : slots)
+		{
+			slot.path = "";
+			for (auto & info : found)
+			{
+				if(!info.valid or info.type != slot.type)
+					continue;
+				bool wanted = slot.type == M64PLUGIN_GFX and video != "" ? info.path == video : notdir(info.path).iequals(slot.fallback);
+				if(wanted or slot.path == "")
+					slot.path = info.path;
+				if(wanted)
+					break;
+			}
+			if(slot.path == "")
+			{
+				std::cout << "UI: No " << slot.label << " plugin found.\n";
+				complete = false;
+			}
+		}
+		std::cout << "UI: Found " << found.size() << " plugin libraries, probed " << probing.size() << ".\n";
+		return complete;
+	}
+	
+	// Loads and starts the chosen plugins once. Safe to call from any thread; later calls wait for the first.
+	bool start()
+	{
+		SDL_LockMutex(lock);
+		if(!started and !failed)
+		{
+			for (auto & slot : slots)
+			{
+				Uint32 begin = SDL_GetTicks();
+				*slot.handle = SDL_LoadObject(slot.path);
+				if(!*slot.handle)
+				{
+					std::cout << SDL_GetError();
+					failed = true;
+					break;
+				}
+				if(API::LoadFunction<ptr_PluginStartup>(&slot.startup, "PluginStartup", *slot.handle))
+				{
+					std::cout << slot.label << " plugin is not a valid m64p plugin (no startup).";
+					failed = true;
+					break;
+				}
+				m64p_error err = slot.startup(core, (void *)slot.label, &debug);
+				if(err)
+				{
+					std::cout << slot.label << " plugin errored while starting up: " << err;
+					failed = true;
+					break;
+				}
+				std::cout << "UI: Started " << slot.label << " plugin " << (const char *)notdir(slot.path) << " in " << SDL_GetTicks()-begin << "ms.\n";
+			}
+			started = !failed;
+		}
+		SDL_UnlockMutex(lock);
+		return started;
+	}
+	
+	static int startscript(void * ptr)
+	{
+		((Plugins *)ptr)->start();
+		return 0;
+	}
+	
+	// Every ROM needs its own attach: plugin_start hands the video plugin the ROM header of the ROM
+	// that is open at the time, and that buffer is freed when the ROM closes.
+	m64p_error attach()
+	{
+		Uint32 begin = SDL_GetTicks();
+		for (unsigned i = 0; i < 4; i++)
+		{
+			m64p_error err = API::CoreAttachPlugin(slots[i].type, *slots[i].handle);
+			if(err != M64ERR_SUCCESS)
+			{
+				std::cout << slots[i].label << " plugin errored while attaching: " << err;
+				while(i-- > 0)
+					API::CoreDetachPlugin(slots[i].type);
+				return err;
+			}
+		}
+		std::cout << "UI: Attaching plugins took " << SDL_GetTicks()-begin << "ms.\n";
+		return M64ERR_SUCCESS;
+	}
+	
+	m64p_error detach()
+	{
+		auto result = M64ERR_SUCCESS;
+		for (unsigned i = 4; i-- > 0;)
+		{
+			m64p_error err = API::CoreDetachPlugin(slots[i].type);
+			if(err != M64ERR_SUCCESS)
+			{
+				std::cout << slots[i].label << " plugin errored while detaching: " << err;
+				result = err;
+			}
+		}
+		return result;
+	}
+	
+	void load(std::map<string, Info> & cache)
+	{
+		file input;
+		if(!input.open("plugins.idx", file::mode::read))
+			return;
+		string magic;
+		for (unsigned i = 0; i < 14; i++)
+			magic.append((char)input.read());
+		if(magic != "panui-plugins\n")
+			return;
+		for (unsigned count = input.readl(2); count and !input.end(); count--)
+		{
+			Info info;
+			info.path = readtext(input);
+			info.mtime = input.readl(8);
+			info.size = input.readl(8);
+			info.valid = input.read();
+			info.type = (m64p_plugin_type)input.readl(4);
+			info.version = input.readl(4);
+			info.apiversion = input.readl(4);
+			info.name = readtext(input);
+			cache[info.path] = info;
+		}
+	}
+	
+	void save()
+	{
+		file output;
+		if(!output.open("plugins.idx", file::mode::write))
+			return;
+		output.print("panui-plugins\n");
+		output.writel(found.size(), 2);
+		for (auto & info : found)
+		{
+			writetext(output, info.path);
+			output.writel(info.mtime, 8);
+			output.writel(info.size, 8);
+			output.write(info.valid);
+			output.writel(info.type, 4);
+			output.writel(info.version, 4);
+			output.writel(info.apiversion, 4);
+			writetext(output, info.name);
+		}
+	}
+} plugins;
+
+// Fast-forward while the hotkey is held. The speed factor climbs a step every half second, and the core
+// hands every change to the audio plugin's SetSpeedFactor so it resamples instead of queueing; at the
+// top step the limiter is switched off too. Releasing the key goes straight back to 100%. GUI thread only.
+struct FastForward
+{
+	static const unsigned levels = 4;
+	int factors[levels];
+	unsigned level;
+	unsigned applied; // last level the core took; it keeps it across ROMs but refuses changes while stopped
+	Uint32 since;
+	
+	FastForward() : level(0), applied(0), since(0)
+	{
+		factors[0] = 100;
+		factors[1] = 200;
+		factors[2] = 300;
+		factors[3] = 500;
+	}
+	
+	void update(bool pressed)
+	{
+		if(pressed and level == 0)
+		{
+			level = 1;
+			since = SDL_GetTicks();
+		}
+		else if(pressed and level < levels-1 and SDL_GetTicks()-since >= 500)
+		{
+			level++;
+			since = SDL_GetTicks();
+		}
+		else if(!pressed)
+			level = 0;
+		
+		if(level == applied or controller.get() != CoreController::State::Running)
+			return;
+		int factor = factors[level];
+		int limiter = level != levels-1;
+		if(API::CoreDoCommand(M64CMD_CORE_STATE_SET, M64CORE_SPEED_FACTOR, &factor) != M64ERR_SUCCESS)
+			return;
+		API::CoreDoCommand(M64CMD_CORE_STATE_SET, M64CORE_SPEED_LIMITER, &limiter);
+		applied = level;
+		if(limiter)
+			std::cout << "UI: Emulation speed " << factor << "%.\n";
+		else
+			std::cout << "UI: Emulation speed uncapped.\n";
+	}
+} fastforward;
+
+struct MainWindow;
+struct LibraryWindow;
+struct SlotWindow;
+
+const char * gprnames[32] = {
+	"r0", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+	"t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+	"s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+	"t8", "t9", "k0", "k1", "gp", "sp", "s8", "ra"
+};
+
+struct MemoryWindow : Window
+{
+	FixedLayout layout;
+	HexEdit display;
+	LineEdit address;
+	CheckButton live;
+	Label status;
+	Timer timer;
+	
+	bool editing;
+	Uint32 inputnum;
+	
+	static const unsigned rows = 0x20;
+	static const unsigned columns = 0x10;
+	
+	// Small cache of 4 KB pages so a redraw touches the core once per page instead of once per byte.
+	// RDRAM pages are copied whole; other pages are filled a word at a time as the view asks for them.
+	// Pages expire after maxage ms, so scrolling within them is served from the cache but running code's
+	// writes still show up.
+	struct Page
+	{
+		Uint32 number;
+		bool valid;
+		Uint32 used;
+		Uint32 loaded; // SDL_GetTicks() when filled
+		Uint32 known[0x1000/4/32];
+		Uint32 words[0x1000/4];
+	};
+	static const unsigned pagecount = 4;
+	static const Uint32 maxage = 250;
+	Page pages[pagecount];
+	Uint32 clock;
+	
+	Uint32 livewords[rows*columns/4];
+	Uint32 liveaddress;
+	bool livevalid;
+	
+	Uint8 readbyte(Uint32 address);
+	void invalidate();
+	MemoryWindow();
+};
+
+// Snapshot of the memory viewer's range, taken by the core thread once per frame and handed to the UI
+// thread through a triple buffer, so neither side ever waits on the other.
+struct LiveMemory
+{
+	static const unsigned size = MemoryWindow::rows*MemoryWindow::columns/4;
+	static const unsigned fresh = 4;
+	Uint32 buffers[3][size];
+	Uint32 addresses[3];
+	unsigned back; // core thread only
+	unsigned front; // UI thread only
+	std::atomic<unsigned> middle; // index of the shared buffer, | fresh if the UI hasn't taken it yet
+	std::atomic<bool> enabled;
+	std::atomic<Uint32> address;
+	
+	LiveMemory() : back(0), front(2), middle(1), enabled(false), address(0x80000000) {}
+	
+	void capture()
+	{
+		if(!enabled)
+			return;
+		Uint32 current = address;
+		Memory::read32(current, buffers[back], size);
+		addresses[back] = current;
+		back = middle.exchange(back | fresh) & 3;
+	}
+	// returns the newest snapshot or NULL if nothing new was published since the last call
+	Uint32 * fetch(Uint32 * snapshot_address)
+	{
+		if(!(middle.load() & fresh))
+			return NULL;
+		front = middle.exchange(front) & 3;
+		*snapshot_address = addresses[front];
+		return buffers[front];
+	}
+} livememory;
+
+// Sampling profiler. Either a background thread or the frame callback reads the core's PC and bumps an
+// open-addressing histogram; nothing is done per instruction, so the emulator doesn't notice it.
+struct Profiler
+{
+	static const unsigned bits = 16;
+	static const unsigned capacity = 1 << bits;
+	std::atomic<Uint32> keys[capacity]; // 0 marks an empty slot
+	std::atomic<Uint32> counts[capacity];
+	std::atomic<Uint32> samples;
+	std::atomic<Uint32> overflow;
+	
+	std::atomic<bool> running;
+	bool perframe;
+	unsigned rate;
+	SDL_Thread * sampler;
+	
+	Profiler() : samples(0), overflow(0), running(false), perframe(false), rate(1000), sampler(NULL)
+	{
+		reset();
+	}
+	
+	void reset()
+	{
+		for (unsigned i = 0; i < capacity; i++)
+		{
+			keys[i].store(0, std::memory_order_relaxed);
+			counts[i].store(0, std::memory_order_relaxed);
+		}
+		samples = 0;
+		overflow = 0;
+	}
+	
+	// the core hands out the address field of the instruction current at the time of the call, so the
+	// pointer has to be asked for again on every sample
+	void sample()
+	{
+		volatile Uint32 * pc = (volatile Uint32 *)API::DebugGetCPUDataPtr(M64P_CPU_PC);
+		if(!pc)
+			return;
+		Uint32 address = *pc;
+		if(!address)
+			return;
+		unsigned slot = ((address >> 2)*2654435761u) >> (32-bits);
+		for (unsigned probe = 0; probe < capacity; probe++, slot = (slot+1) & (capacity-1))
+		{
+			Uint32 key = keys[slot].load(std::memory_order_relaxed);
+			if(key == 0)
+			{
+				keys[slot].store(address, std::memory_order_relaxed);
+				key = address;
+			}
+			if(key == address)
+			{
+				counts[slot].fetch_add(1, std::memory_order_relaxed);
+				samples++;
+				return;
+			}
+		}
+		overflow++;
+	}
+	
+	void frame()
+	{
+		if(running and perframe)
+			sample();
+	}
+	
+	static int samplerscript(void * ptr)
+	{
+		Profiler & self = *(Profiler *)ptr;
+		Uint32 interval = max(1u, 1000/max(1u, self.rate));
+		while(self.running)
+		{
+			self.sample();
+			SDL_Delay(interval);
+		}
+		return 0;
+	}
+	
+	bool start(bool arg_perframe, unsigned arg_rate)
+	{
+		if(running)
+			return false;
+		if(!API::DebugGetCPUDataPtr(M64P_CPU_PC))
+			return false;
+		perframe = arg_perframe;
+		rate = arg_rate;
+		running = true;
+		if(!perframe)
+			sampler = SDL_CreateThread(samplerscript, "Profiler", this);
+		return true;
+	}
+	
+	void stop()
+	{
+		running = false;
+		if(sampler)
+			SDL_WaitThread(sampler, NULL);
+		sampler = NULL;
+	}
+} profiler;
+
+// Headless batch runs for smoke-testing many ROMs. "panui --batch [options] roms..." starts a worker
+// process per ROM, up to --jobs at once, and prints a table of what they report. A worker
+// ("--batch-worker") boots its ROM without a window, runs it with the speed limiter off and hashes
+// the screen at the --at frames until --frames have been emulated. --core and --video swap in other
+// libraries, e.g. a stub core.
+struct BatchRun
+{
+	string corename;
+	string video;
+	unsigned frames;
+	std::vector<unsigned> at;
+	unsigned jobs;
+	unsigned timeout;
+	lstring roms;
+	
+	// worker; frame() runs on the core thread, which is the one that called work()
+	std::atomic<bool> active;
+	std::atomic<bool> executing; // inside M64CMD_EXECUTE, for the watchdog
+	std::atomic<bool> timedout;
+	unsigned count;
+	unsigned shot;
+	lstring hashes;
+	string status;
+	
+	BatchRun() : corename("mupen64plus.dll"), frames(600), jobs(0), timeout(60000), active(false), executing(false), timedout(false), count(0), shot(0) {}
+	
+	void frame()
+	{
+		if(!active)
+			return;
+		count++;
+		if(shot < at.size() and count == at[shot])
+		{
+			int size = 0;
+			API::CoreDoCommand(M64CMD_CORE_STATE_QUERY, M64CORE_VIDEO_SIZE, &size);
+			unsigned length = (size >> 16 & 0xFFFF)*(size & 0xFFFF)*3;
+			std::vector<uint8_t> pixels(max(length, 1u));
+			string hash = "none";
+			if(length and API::CoreDoCommand(M64CMD_READ_SCREEN, 0, pixels.data()) == M64ERR_SUCCESS)
+				hash = hex<8>(crc32_calculate(pixels.data(), length));
+			hashes.append({at[shot], "=", hash});
+			shot++;
+		}
+		if(count >= frames)
+		{
+			active = false;
+			status = "ok";
+			API::CoreDoCommand(M64CMD_STOP, 0, NULL);
+		}
+	}
+	
+	bool parse(int argc, char * argv[]);
+	string options() const;
+	int work();
+	int coordinate(const char * self);
+	static int watchdog(void * ptr);
+	struct Job
+	{
+		BatchRun * self;
+		const char * program;
+		std::atomic<unsigned> * next;
+		lstring * results;
+	};
+	static int jobscript(void * ptr);
+} batch;
+
+// Frame pacing. The core thread timestamps every frame (and every VI, when the debugger delivers them)
+// into fixed histograms of 0.1ms buckets, which costs two relaxed atomic adds and no allocation. The GUI
+// thread diffs the counters against its last look to get min/avg/p99/max for the interval since then.
+struct FrameTiming
+{
+	static const unsigned buckets = 1024; // the last bucket also takes everything slower
+	struct Histogram
+	{
+		std::atomic<Uint32> counts[buckets];
+		std::atomic<uint64_t> total; // microseconds
+		Uint64 last; // core thread only
+		
+		// GUI thread's copy from the previous summary
+		Uint32 seen[buckets];
+		uint64_t seentotal;
+		
+		Histogram() : total(0), last(0), seentotal(0)
+		{
+			for (unsigned i = 0; i < buckets; i++)
+			{
+				counts[i] = 0;
+				seen[i] = 0;
+			}
+		}
+		
+		void add(Uint64 now, Uint64 frequency)
+		{
+			Uint64 previous = last;
+			last = now;
+			uint64_t micro = (now-previous)*1000000/frequency;
+			if(!previous or micro > 1000000) // first event, or the core was paused or stopped in between
+				return;
+			counts[min(micro/100, (uint64_t)buckets-1)].fetch_add(1, std::memory_order_relaxed);
+			total.fetch_add(micro, std::memory_order_relaxed);
+		}
+	};
+	struct Summary
+	{
+		Uint32 count;
+		double min, avg, p99, max; // milliseconds
+	};
+	
+	Histogram frames;
+	Histogram vis;
+	Uint64 frequency;
+	unsigned rate; // VIs per second at full speed
+	Uint64 lastsummary;
+	
+	FrameTiming() : frequency(0), rate(60), lastsummary(0) {}
+	
+	// core thread
+	void frame()
+	{
+		frames.add(SDL_GetPerformanceCounter(), frequency);
+	}
+	void vi()
+	{
+		vis.add(SDL_GetPerformanceCounter(), frequency);
+	}
+	
+	// GUI thread
+	Summary summarize(Histogram & histogram)
+	{
+		Uint32 delta[buckets];
+		Summary summary = {0, 0, 0, 0, 0};
+		for (unsigned i = 0; i < buckets; i++)
+		{
+			Uint32 now = histogram.counts[i].load(std::memory_order_relaxed);
+			delta[i] = now-histogram.seen[i];
+			histogram.seen[i] = now;
+			summary.count += delta[i];
+		}
+		uint64_t total = histogram.total.load(std::memory_order_relaxed);
+		uint64_t micro = total-histogram.seentotal;
+		histogram.seentotal = total;
+		if(!summary.count)
+			return summary;
+		
+		summary.avg = micro/1000.0/summary.count;
+		Uint32 running = 0;
+		bool first = true;
+		for (unsigned i = 0; i < buckets; i++)
+		{
+			if(!delta[i])
+				continue;
+			if(first)
+				summary.min = i/10.0;
+			first = false;
+			if(running < summary.count*99/100 and running+delta[i] >= summary.count*99/100)
+				summary.p99 = (i+1)/10.0;
+			running += delta[i];
+			summary.max = (i+1)/10.0;
+		}
+		return summary;
+	}
+	
+	// frame and VI summaries since the last call plus emulation speed in percent; speed uses VIs when
+	// the core reports them and otherwise assumes one frame per VI
+	void sample(Summary & frame, Summary & vi, double & speed)
+	{
+		Uint64 now = SDL_GetPerformanceCounter();
+		double seconds = lastsummary ? double(now-lastsummary)/frequency : 0;
+		lastsummary = now;
+		frame = summarize(frames);
+		vi = summarize(vis);
+		Uint32 count = vi.count ? vi.count : frame.count;
+		speed = seconds > 0 ? count/seconds/rate*100 : 0;
+	}
+} frametiming;
+
+// Rewind. Every interval frames the frame callback asks the core for an uncompressed (PJ64 format)
+// savestate in a scratch file, which is all the frame callback itself does. Once the core reports it
+// written, a worker XORs it against the previous capture and run-length encodes the delta, which is
+// mostly zeros, into a ring inside a preallocated arena. Stepping back undoes the newest delta in place
+// and hands the result to M64CMD_STATE_LOAD.
+struct Rewind
+{
+	static const unsigned arenasize = 256 << 20;
+	struct Delta
+	{
+		unsigned offset;
+		unsigned length;
+	};
+	
+	uint8_t * arena;
+	unsigned head; // next free arena offset
+	std::deque<Delta> deltas; // oldest first; only ever dropped from the front or undone from the back
+	uint8_t * latest; // last state captured or restored
+	uint8_t * incoming;
+	uint8_t * scratch;
+	unsigned size;
+	
+	unsigned interval;
+	unsigned frames; // core thread
+	std::atomic<bool> enabled;
+	std::atomic<bool> holding; // GUI is holding the rewind key; no captures meanwhile
+	std::atomic<bool> busy; // a capture or restore is in flight
+	std::atomic<bool> saved;
+	std::atomic<bool> stale; // a different ROM was loaded since the last capture
+	std::atomic<int> steps;
+	SDL_sem * wake;
+	SDL_sem * loaded;
+	SDL_Thread * worker;
+	
+	Rewind() : arena(NULL), head(0), latest(NULL), incoming(NULL), scratch(NULL), size(0), interval(30), frames(0),
+	           enabled(false), holding(false), busy(false), saved(false), stale(false), steps(0), wake(NULL), loaded(NULL), worker(NULL) {}
+	
+	static uint8_t * putvarint(uint8_t * out, unsigned value)
+	{
+		while(value >= 0x80)
+		{
+			*out++ = value | 0x80;
+			value >>= 7;
+		}
+		*out++ = value;
+		return out;
+	}
+	static const uint8_t * getvarint(const uint8_t * in, unsigned & value)
+	{
+		value = 0;
+		for (unsigned shift = 0; ; shift += 7)
+		{
+			value |= (*in & 0x7F) << shift;
+			if(!(*in++ & 0x80))
+				return in;
+		}
+	}
+	
+	// Writes a ^ b as (zero run, literal run, literal bytes) triples; a literal run only ends at eight
+	// equal bytes in a row, so short gaps stay inline. Output is at most about 1.25 * size.
+	static unsigned encode(uint8_t * out, const uint8_t * a, const uint8_t * b, unsigned size)
+	{
+		uint8_t * start = out;
+		unsigned i = 0;
+		while(i < size)
+		{
+			unsigned zeros = i;
+			while(i+8 <= size and *(const uint64_t *)(a+i) == *(const uint64_t *)(b+i))
+				i += 8;
+			while(i < size and a[i] == b[i])
+				i++;
+			zeros = i-zeros;
+			unsigned literal = i;
+			unsigned equal = 0;
+			while(i < size and equal < 8)
+			{
+				equal = a[i] == b[i] ? equal+1 : 0;
+				i++;
+			}
+			i -= equal;
+			out = putvarint(out, zeros);
+			out = putvarint(out, i-literal);
+			for (unsigned j = literal; j < i; j++)
+				*out++ = a[j] ^ b[j];
+		}
+		return out-start;
+	}
+	static void apply(uint8_t * state, const uint8_t * in, unsigned length)
+	{
+		const uint8_t * end = in+length;
+		while(in < end)
+		{
+			unsigned zeros, literal;
+			in = getvarint(in, zeros);
+			in = getvarint(in, literal);
+			state += zeros;
+			for (unsigned j = 0; j < literal; j++)
+				*state++ ^= *in++;
+		}
+	}
+	
+	unsigned allocate(unsigned length)
+	{
+		if(head+length > arenasize)
+		{
+			// the end of the arena is abandoned for this lap; whatever still lives there is the oldest history
+			while(deltas.size() and deltas.front().offset >= head)
+				deltas.pop_front();
+			head = 0;
+		}
+		while(deltas.size() and deltas.front().offset >= head and deltas.front().offset < head+length)
+			deltas.pop_front();
+		unsigned offset = head;
+		head += length;
+		return offset;
+	}
+	
+	void capture()
+	{
+		unsigned length = file::size("rewind.tmp");
+		if(length != size or stale)
+		{
+			// new ROM or first capture: start over from a fresh base state
+			stale = false;
+			deltas.clear();
+			head = 0;
+			size = length;
+			free(latest);
+			free(incoming);
+			free(scratch);
+			latest = (uint8_t *)malloc(size);
+			incoming = (uint8_t *)malloc(size);
+			scratch = (uint8_t *)malloc(size+size/4+64);
+			file::read("rewind.tmp", latest, size);
+			return;
+		}
+		if(!file::read("rewind.tmp", incoming, size))
+			return;
+		unsigned encoded = encode(scratch, incoming, latest, size);
+		if(encoded > arenasize)
+			return;
+		Delta delta = {allocate(encoded), encoded};
+		memcpy(arena+delta.offset, scratch, encoded);
+		deltas.push_back(delta);
+		std::swap(latest, incoming);
+	}
+	
+	void stepback()
+	{
+		if(deltas.empty())
+			return;
+		for (unsigned tries = 0; !claimstate(StateJob::Rewind); tries++)
+		{
+			if(tries == 100)
+				return;
+			SDL_Delay(10);
+		}
+		// the history only gives up the delta once the core has taken the older state
+		Delta delta = deltas.back();
+		memcpy(incoming, latest, size);
+		apply(incoming, arena+delta.offset, delta.length);
+		busy = true;
+		while(SDL_SemTryWait(loaded) == 0);
+		if(file::write("rewind-load.tmp", incoming, size) and API::CoreDoCommand(M64CMD_STATE_LOAD, 0, (void *)"rewind-load.tmp") == M64ERR_SUCCESS)
+		{
+			deltas.pop_back();
+			head = delta.offset;
+			std::swap(latest, incoming);
+			SDL_SemWaitTimeout(loaded, 1000);
+		}
+		else
+			statejob = StateJob::None;
+		busy = false;
+	}
+	
+	static int workerscript(void * ptr)
+	{
+		Rewind & self = *(Rewind *)ptr;
+		while(true)
+		{
+			SDL_SemWait(self.wake);
+			if(self.saved)
+			{
+				self.saved = false;
+				// rewind may have been switched off while this capture was in flight
+				if(self.enabled)
+					self.capture();
+				self.busy = false;
+			}
+			while(self.steps > 0)
+			{
+				self.steps--;
+				self.stepback();
+			}
+		}
+		return 0;
+	}
+	
+	// GUI thread
+	bool enable(bool on)
+	{
+		if(on and !arena)
+		{
+			arena = (uint8_t *)malloc(arenasize);
+			if(!arena)
+			{
+				std::cout << "UI: Could not reserve memory for rewind.\n";
+				return false;
+			}
+			wake = SDL_CreateSemaphore(0);
+			loaded = SDL_CreateSemaphore(0);
+			worker = SDL_CreateThread(workerscript, "Rewind", this);
+		}
+		stale = true;
+		enabled = on;
+		return true;
+	}
+	void hold(bool pressed)
+	{
+		if(!enabled)
+			return;
+		holding = pressed;
+		if(pressed and !busy and steps == 0)
+		{
+			steps++;
+			SDL_SemPost(wake);
+		}
+	}
+	
+	// core thread
+	void frame()
+	{
+		if(!enabled or holding or busy or ++frames < interval or !claimstate(StateJob::Rewind))
+			return;
+		frames = 0;
+		busy = true;
+		if(API::CoreDoCommand(M64CMD_STATE_SAVE, 3, (void *)"rewind.tmp") != M64ERR_SUCCESS)
+		{
+			statejob = StateJob::None;
+			busy = false;
+		}
+	}
+	// the core went away with our job still queued
+	void abandon()
+	{
+		busy = false;
+		if(loaded)
+			SDL_SemPost(loaded);
+	}
+	// handled even when rewind was just switched off, or busy would never clear; the worker drops the state
+	void complete(m64p_core_param param, int value)
+	{
+		if(!busy)
+			return;
+		if(param == M64CORE_STATE_SAVECOMPLETE)
+		{
+			saved = value != 0;
+			if(!saved)
+				busy = false;
+			SDL_SemPost(wake);
+		}
+		else if(param == M64CORE_STATE_LOADCOMPLETE)
+			SDL_SemPost(loaded);
+	}
+} rewinder;
+
+// Gameplay recording for bug reports. The core thread copies each frame with READ_SCREEN into the next
+// free buffer of a fixed ring and never waits: when the encoder hasn't freed one, the frame is dropped
+// and counted. The encoder thread stores each frame losslessly as the rewind codec's XOR delta against
+// the previous frame (against black every keyinterval frames, so a file can be entered there). Records
+// carry the frame number, which leaves gaps where frames were dropped, and microseconds since the start.
+struct Capture
+{
+	static const unsigned slots = 16;
+	static const unsigned keyinterval = 300;
+	struct Frame
+	{
+		std::vector<uint8_t> pixels; // RGB, bottom row first, as READ_SCREEN gives it
+		Uint32 number;
+		Uint64 micros;
+	};
+	Frame ring[slots];
+	std::atomic<Uint32> head; // frames handed to the encoder
+	std::atomic<Uint32> tail; // frames it has finished with
+	std::atomic<bool> recording;
+	std::atomic<bool> stopping;
+	std::atomic<Uint32> frames;
+	std::atomic<Uint32> dropped;
+	std::atomic<uint64_t> written;
+	
+	unsigned width;
+	unsigned height;
+	Uint32 number; // core thread
+	Uint64 begin;
+	Uint64 frequency;
+	string filename;
+	file output;
+	std::atomic<SDL_Thread *> encoder; // the boot thread stops a recording when emulation ends, the GUI when asked
+	
+	Capture() : head(0), tail(0), recording(false), stopping(false), frames(0), dropped(0), written(0),
+	            width(0), height(0), number(0), begin(0), frequency(1), encoder(NULL) {}
+	
+	// core thread
+	void frame()
+	{
+		if(!recording)
+			return;
+		number++;
+		Uint32 at = head.load(std::memory_order_relaxed);
+		int size = 0;
+		API::CoreDoCommand(M64CMD_CORE_STATE_QUERY, M64CORE_VIDEO_SIZE, &size);
+		// a resized window would need new buffers, which this thread doesn't allocate
+		if(at-tail.load(std::memory_order_acquire) == slots or (unsigned)(size >> 16 & 0xFFFF) != width or (unsigned)(size & 0xFFFF) != height)
+		{
+			dropped++;
+			return;
+		}
+		Frame & next = ring[at % slots];
+		if(API::CoreDoCommand(M64CMD_READ_SCREEN, 0, next.pixels.data()) != M64ERR_SUCCESS)
+		{
+			dropped++;
+			return;
+		}
+		next.number = number;
+		next.micros = (SDL_GetPerformanceCounter()-begin)*1000000/frequency;
+		head.store(at+1, std::memory_order_release);
+		frames++;
+	}
+	
+	static int encoderscript(void * ptr)
+	{
+		Capture & self = *(Capture *)ptr;
+		unsigned length = self.width*self.height*3;
+		std::vector<uint8_t> previous(length);
+		std::vector<uint8_t> packed(length+length/4+64);
+		Uint32 encoded = 0;
+		while(true)
+		{
+			Uint32 begin = self.tail.load(std::memory_order_relaxed);
+			if(begin == self.head.load(std::memory_order_acquire))
+			{
+				if(self.stopping)
+					break;
+				SDL_Delay(2);
+				continue;
+			}
+			Frame & frame = self.ring[begin % slots];
+			bool key = encoded++ % keyinterval == 0;
+			if(key)
+				memset(previous.data(), 0, length);
+			unsigned size = Rewind::encode(packed.data(), frame.pixels.data(), previous.data(), length);
+			memcpy(previous.data(), frame.pixels.data(), length);
+			self.output.write(key ? 'K' : 'D');
+			self.output.writel(frame.number, 4);
+			self.output.writel(frame.micros, 8);
+			self.output.writel(size, 4);
+			self.output.write(packed.data(), size);
+			self.written += 1+4+8+4+size;
+			self.tail.store(begin+1, std::memory_order_release);
+		}
+		self.output.close();
+		return 0;
+	}
+	
+	// GUI thread
+	bool start()
+	{
+		auto state = controller.get();
+		if(recording or encoder or (state != CoreController::State::Running and state != CoreController::State::Paused))
+			return false;
+		int size = 0;
+		API::CoreDoCommand(M64CMD_CORE_STATE_QUERY, M64CORE_VIDEO_SIZE, &size);
+		width = size >> 16 & 0xFFFF;
+		height = size & 0xFFFF;
+		if(!width or !height)
+			return false;
+		string name = romname != "" ? basename(notdir(romname)) : string("panui");
+		unsigned take = 0;
+		do filename = {name, ".rec", take++, ".panv"};
+		while(file::exists(filename));
+		if(!output.open(filename, file::mode::write))
+			return false;
+		output.print("panui-video\n");
+		output.writel(width, 2);
+		output.writel(height, 2);
+		output.writel(keyinterval, 2);
+		
+		for (auto & frame : ring)
+			frame.pixels.resize(width*height*3);
+		head = tail = 0;
+		frames = dropped = 0;
+		written = 0;
+		number = 0;
+		frequency = SDL_GetPerformanceFrequency();
+		begin = SDL_GetPerformanceCounter();
+		stopping = false;
+		encoder = SDL_CreateThread(encoderscript, "Capture", this);
+		recording = true;
+		std::cout << "UI: Recording " << width << "x" << height << " to " << (const char *)filename << ".\n";
+		return true;
+	}
+	
+	// the encoder drains what was already grabbed before it exits; whoever takes the thread joins it
+	void stop()
+	{
+		SDL_Thread * thread = encoder.exchange(NULL);
+		if(!thread)
+			return;
+		recording = false;
+		stopping = true;
+		SDL_WaitThread(thread, NULL);
+		std::cout << "UI: Recorded " << frames.load() << " frames to " << (const char *)filename << " (" << written.load()/1024 << "KB), dropped " << dropped.load() << ".\n";
+	}
+} capture;
+
+// Condition for "run until", converted once from nall's Eval tree so the core thread only does
+// integer math per instruction. Names are pc and the usual MIPS register names.
+struct Condition
+{
+	enum class Kind : unsigned { Constant, PC, Register, Operator };
+	Kind kind;
+	Eval::Node::Type type;
+	int64_t value;
+	std::vector<Condition> links;
+	
+	// throws const char * on anything it can't evaluate
+	void compile(Eval::Node * node)
+	{
+		type = node->type;
+		if(node->type == Eval::Node::Type::Literal)
+		{
+			string & literal = node->literal;
+			kind = Kind::Constant;
+			if(literal == "pc")
+			{
+				kind = Kind::PC;
+				return;
+			}
+			for (unsigned i = 0; i < 32; i++)
+			{
+				if(literal == gprnames[i])
+				{
+					kind = Kind::Register;
+					value = i;
+					return;
+				}
+			}
+			if(literal.beginsWith("0x"))
+				value = hex(literal);
+			else if(literal[0] >= '0' and literal[0] <= '9')
+				value = integer(literal);
+			else
+				throw "unknown name";
+			return;
+		}
+		switch(node->type)
+		{
+		case Eval::Node::Type::LogicalNot: case Eval::Node::Type::BitwiseNot: case Eval::Node::Type::Negative:
+		case Eval::Node::Type::Multiply: case Eval::Node::Type::Add: case Eval::Node::Type::Subtract:
+		case Eval::Node::Type::ShiftLeft: case Eval::Node::Type::ShiftRight:
+		case Eval::Node::Type::BitwiseAnd: case Eval::Node::Type::BitwiseOr: case Eval::Node::Type::BitwiseXor:
+		case Eval::Node::Type::Equal: case Eval::Node::Type::NotEqual:
+		case Eval::Node::Type::LessThanEqual: case Eval::Node::Type::GreaterThanEqual:
+		case Eval::Node::Type::LessThan: case Eval::Node::Type::GreaterThan:
+		case Eval::Node::Type::LogicalAnd: case Eval::Node::Type::LogicalOr:
+			break;
+		default:
+			throw "unsupported operator";
+		}
+		kind = Kind::Operator;
+		links.resize(node->link.size());
+		for (unsigned i = 0; i < node->link.size(); i++)
+			links[i].compile(node->link[i]);
+	}
+	
+	int64_t evaluate(Uint32 pc, const int64_t * gpr) const
+	{
+		switch(kind)
+		{
+		case Kind::Constant: return value;
+		case Kind::PC: return pc;
+		case Kind::Register: return gpr[value];
+		case Kind::Operator: break;
+		}
+		#define p(n) links[n].evaluate(pc, gpr)
+		switch(type)
+		{
+		case Eval::Node::Type::LogicalNot: return !p(0);
+		case Eval::Node::Type::BitwiseNot: return ~p(0);
+		case Eval::Node::Type::Negative: return -p(0);
+		case Eval::Node::Type::Multiply: return p(0) * p(1);
+		case Eval::Node::Type::Add: return p(0) + p(1);
+		case Eval::Node::Type::Subtract: return p(0) - p(1);
+		case Eval::Node::Type::ShiftLeft: return p(0) << p(1);
+		case Eval::Node::Type::ShiftRight: return p(0) >> p(1);
+		case Eval::Node::Type::BitwiseAnd: return p(0) & p(1);
+		case Eval::Node::Type::BitwiseOr: return p(0) | p(1);
+		case Eval::Node::Type::BitwiseXor: return p(0) ^ p(1);
+		case Eval::Node::Type::Equal: return p(0) == p(1);
+		case Eval::Node::Type::NotEqual: return p(0) != p(1);
+		case Eval::Node::Type::LessThanEqual: return p(0) <= p(1);
+		case Eval::Node::Type::GreaterThanEqual: return p(0) >= p(1);
+		case Eval::Node::Type::LessThan: return p(0) < p(1);
+		case Eval::Node::Type::GreaterThan: return p(0) > p(1);
+		case Eval::Node::Type::LogicalAnd: return p(0) && p(1);
+		case Eval::Node::Type::LogicalOr: return p(0) || p(1);
+		default: return 0;
+		}
+		#undef p
+	}
+};
+
+// A stepping batch armed by the UI and run by the core thread from the debugger update callback, which
+// the core calls before every instruction while the debug run state is 1. When the batch is done the
+// callback drops the run state to 0, so the core blocks right there until the next DebugStep.
+struct CommandBatch
+{
+	std::atomic<bool> active;
+	std::atomic<bool> finished;
+	std::atomic<bool> cancelled; // "stop": ends the batch at the next instruction
+	unsigned limit; // 0: no step limit
+	unsigned steps;
+	bool logging;
+	bool conditional;
+	Condition until;
+	std::vector<Uint32> log;
+	const int64_t * gpr;
+	Uint32 lastpc;
+	
+	CommandBatch() : active(false), finished(false), cancelled(false) {}
+	
+	void update(unsigned int pc)
+	{
+		if(!active)
+			return;
+		steps++;
+		if(logging and log.size() < log.capacity())
+			log.push_back(pc);
+		bool done = cancelled or (limit and steps >= limit) or (conditional and until.evaluate(pc, gpr) != 0);
+		if(done)
+		{
+			lastpc = pc;
+			active = false;
+			API::DebugSetRunState(0);
+			finished = true;
+		}
+	}
+} commandbatch;
+
+// Frontend mirror of the core's breakpoints. The exec breakpoints are kept sorted by start address with
+// a running maximum of end addresses, so the update callback can find the ones covering a PC with a
+// binary search and then decide whether a conditional stop should be skipped.
+struct BreakpointIndex
+{
+	struct Entry
+	{
+		Uint32 begin;
+		Uint32 end;
+		Uint32 reach; // largest end among this entry and the ones before it
+		unsigned source;
+		bool conditional;
+		Condition condition;
+	};
+	std::vector<Entry> entries;
+	
+	enum class Match : unsigned { None, Hit, Skip };
+	
+	Match match(Uint32 pc, const int64_t * gpr, std::atomic<unsigned> * hits) const
+	{
+		unsigned low = 0, high = entries.size();
+		while(low < high)
+		{
+			unsigned middle = (low+high)/2;
+			if(entries[middle].begin <= pc)
+				low = middle+1;
+			else
+				high = middle;
+		}
+		Match result = Match::None;
+		for (unsigned i = low; i-- > 0 and entries[i].reach >= pc;)
+		{
+			const Entry & entry = entries[i];
+			if(entry.end < pc)
+				continue;
+			if(!entry.conditional or entry.condition.evaluate(pc, gpr) != 0)
+			{
+				hits[entry.source]++;
+				result = Match::Hit;
+			}
+			else if(result == Match::None)
+				result = Match::Skip;
+		}
+		return result;
+	}
+};
+
+struct Breakpoints
+{
+	struct Breakpoint
+	{
+		Uint32 begin;
+		Uint32 end;
+		Uint32 flags; // M64P_BKP_FLAG_*
+		string condition;
+	};
+	std::vector<Breakpoint> list; // UI thread only
+	std::atomic<unsigned> hits[BREAKPOINTS_MAX_NUMBER];
+	
+	std::atomic<BreakpointIndex *> index;
+	std::atomic<bool> reading;
+	std::atomic<bool> stepping; // the next update is a single step asked for by the UI, not a breakpoint stop
+	const int64_t * gpr;
+	
+	Breakpoints() : index(NULL), reading(false), stepping(false), gpr(NULL)
+	{
+		for (auto & hit : hits)
+			hit = 0;
+	}
+	
+	// throws const char * for a bad condition
+	bool add(Uint32 begin, Uint32 end, Uint32 flags, const string & condition)
+	{
+		if(list.size() >= BREAKPOINTS_MAX_NUMBER)
+			return false;
+		// only exec breakpoints go through the index that evaluates conditions
+		if(condition != "" and (flags & (M64P_BKP_FLAG_READ | M64P_BKP_FLAG_WRITE)))
+			throw "Conditions only work on exec breakpoints.";
+		if(condition != "")
+		{
+			Condition test;
+			Eval::Node * tree = Eval::parse(condition);
+			try { test.compile(tree); }
+			catch(const char *) { delete tree; throw; }
+			delete tree;
+		}
+		hits[list.size()] = 0;
+		list.push_back({begin, end, flags | M64P_BKP_FLAG_ENABLED, condition});
+		sync();
+		return true;
+	}
+	void remove(unsigned position)
+	{
+		if(position >= list.size())
+			return;
+		list.erase(list.begin()+position);
+		for (unsigned i = position; i < list.size(); i++)
+			hits[i] = hits[i+1].load();
+		sync();
+	}
+	void enable(unsigned position, bool enabled)
+	{
+		if(position >= list.size())
+			return;
+		if(enabled)
+			list[position].flags |= M64P_BKP_FLAG_ENABLED;
+		else
+			list[position].flags &= ~M64P_BKP_FLAG_ENABLED;
+		sync();
+	}
+	
+	// The core compacts its table on removal, so its indices can't be tracked across edits; the whole
+	// table (at most BREAKPOINTS_MAX_NUMBER entries) is rewritten instead.
+	void sync()
+	{
+		while(API::DebugGetState(M64P_DBG_NUM_BREAKPOINTS) > 0)
+			API::DebugBreakpointCommand(M64P_BKP_CMD_REMOVE_IDX, 0, NULL);
+		
+		BreakpointIndex * fresh = new BreakpointIndex;
+		for (unsigned i = 0; i < list.size(); i++)
+		{
+			m64p_breakpoint breakpoint = {list[i].begin, list[i].end, list[i].flags};
+			API::DebugBreakpointCommand(M64P_BKP_CMD_ADD_STRUCT, 0, &breakpoint);
+			if(!(list[i].flags & M64P_BKP_FLAG_EXEC) or !(list[i].flags & M64P_BKP_FLAG_ENABLED))
+				continue;
+			BreakpointIndex::Entry entry;
+			entry.begin = list[i].begin;
+			entry.end = list[i].end;
+			entry.source = i;
+			entry.conditional = list[i].condition != "";
+			if(entry.conditional)
+			{
+				Eval::Node * tree = Eval::parse(list[i].condition);
+				entry.condition.compile(tree);
+				delete tree;
+			}
+			fresh->entries.push_back(entry);
+		}
+		std::sort(fresh->entries.begin(), fresh->entries.end(), [](const BreakpointIndex::Entry & a, const BreakpointIndex::Entry & b)
+		{
+			return a.begin < b.begin;
+		});
+		Uint32 reach = 0;
+		for (auto & entry : fresh->entries)
+			entry.reach = reach = max(reach, entry.end);
+		
+		gpr = (const int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_REG);
+		BreakpointIndex * old = index.exchange(fresh);
+		// the core thread is the only reader; wait out a lookup that might still hold the old index
+		while(reading)
+			SDL_Delay(0);
+		delete old;
+	}
+	
+	// core thread
+	BreakpointIndex::Match match(Uint32 pc)
+	{
+		reading = true;
+		BreakpointIndex * current = index;
+		BreakpointIndex::Match result = BreakpointIndex::Match::None;
+		if(current and gpr)
+			result = current->match(pc, gpr, hits);
+		reading = false;
+		return result;
+	}
+} breakpoints;
+
+// Execution trace. The update callback encodes each PC (and optionally the GPRs that changed) as
+// signed varint deltas into a fixed ring; a background thread drains the ring to disk. If the writer
+// falls behind, records are dropped and counted instead of stalling the core.
+// Register deltas wrap in 64 bits, so they're taken unsigned and zigzagged here; nall's writevs would
+// overflow on the negation and drop the top bit on the shift.
+inline uint64_t zigzag(uint64_t delta)
+{
+	return delta << 1 ^ (0-(delta >> 63));
+}
+inline uint64_t unzigzag(uint64_t value)
+{
+	return value >> 1 ^ (0-(value & 1));
+}
+
+struct TraceRecorder : varint
+{
+	static const Uint32 size = 0x1000000;
+	static const Uint32 largest = 8+1+32*(1+10); // worst-case record with every register changed
+	Uint8 * ring;
+	Uint32 cursor; // core thread's write position, published through head after each record
+	std::atomic<Uint32> head;
+	std::atomic<Uint32> tail;
+	std::atomic<bool> recording;
+	std::atomic<bool> stopping;
+	std::atomic<Uint32> records;
+	std::atomic<Uint32> dropped;
+	std::atomic<Uint32> written;
+	
+	bool registers;
+	const int64_t * gpr;
+	Uint32 lastpc;
+	int64_t last[32];
+	file output;
+	SDL_Thread * writer;
+	
+	TraceRecorder() : ring(NULL), head(0), tail(0), recording(false), stopping(false), records(0), dropped(0), written(0), writer(NULL) {}
+	
+	uint8_t read() { return 0; }
+	void write(uint8_t data)
+	{
+		ring[cursor++ & (size-1)] = data;
+	}
+	
+	void record(Uint32 pc)
+	{
+		if(!recording)
+			return;
+		cursor = head.load(std::memory_order_relaxed);
+		if(size-(cursor-tail.load(std::memory_order_acquire)) < largest)
+		{
+			dropped++;
+			return;
+		}
+		writevs((int64_t)pc-(int64_t)lastpc);
+		lastpc = pc;
+		if(registers)
+		{
+			Uint8 changed = 0;
+			for (unsigned i = 0; i < 32; i++)
+				changed += gpr[i] != last[i];
+			write(changed);
+			for (unsigned i = 0; i < 32; i++)
+			{
+				if(gpr[i] == last[i])
+					continue;
+				write(i);
+				writevu(zigzag((uint64_t)gpr[i]-(uint64_t)last[i]));
+				last[i] = gpr[i];
+			}
+		}
+		head.store(cursor, std::memory_order_release);
+		records++;
+	}
+	
+	static int writerscript(void * ptr)
+	{
+		TraceRecorder & self = *(TraceRecorder *)ptr;
+		while(true)
+		{
+			Uint32 end = self.head.load(std::memory_order_acquire);
+			Uint32 begin = self.tail.load(std::memory_order_relaxed);
+			if(begin == end)
+			{
+				if(self.stopping)
+					break;
+				SDL_Delay(5);
+				continue;
+			}
+			// at most two pieces when the filled part wraps around the end of the ring
+			Uint32 offset = begin & (size-1);
+			Uint32 length = min(end-begin, size-offset);
+			self.output.write(self.ring+offset, length);
+			self.written += length;
+			self.tail.store(begin+length, std::memory_order_release);
+		}
+		self.output.close();
+		return 0;
+	}
+	
+	bool start(const string & filename, bool with_registers)
+	{
+		if(recording or writer)
+			return false;
+		gpr = (const int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_REG);
+		if(with_registers and !gpr)
+			return false;
+		if(!output.open(filename, file::mode::write))
+			return false;
+		if(!ring)
+			ring = (Uint8 *)malloc(size);
+		
+		output.print("panui-trace\n");
+		output.write(with_registers);
+		
+		registers = with_registers;
+		lastpc = 0;
+		memset(last, 0, sizeof(last));
+		head = tail = 0;
+		records = dropped = written = 0;
+		stopping = false;
+		writer = SDL_CreateThread(writerscript, "TraceWriter", this);
+		recording = true;
+		// the update callback only runs for every instruction in run state 1
+		if(API::DebugGetState(M64P_DBG_RUN_STATE) == 2)
+			API::DebugSetRunState(1);
+		return true;
+	}
+	
+	void stop()
+	{
+		if(!writer)
+			return;
+		recording = false;
+		if(API::DebugGetState(M64P_DBG_RUN_STATE) == 1 and !commandbatch.active)
+			API::DebugSetRunState(2);
+		stopping = true;
+		SDL_WaitThread(writer, NULL);
+		writer = NULL;
+	}
+} tracer;
+
+// Turns a binary trace into one line per instruction
+struct TraceReader : varint
+{
+	file & input;
+	TraceReader(file & input) : input(input) {}
+	uint8_t read() { return input.read(); }
+	void write(uint8_t) {}
+	
+	static bool exporttext(const string & source, const string & target)
+	{
+		file input, output;
+		if(!input.open(source, file::mode::read) or !output.open(target, file::mode::write))
+			return false;
+		string magic;
+		for (unsigned i = 0; i < 12; i++)
+			magic.append((char)input.read());
+		if(magic != "panui-trace\n")
+			return false;
+		bool registers = input.read();
+		
+		TraceReader reader(input);
+		Uint32 pc = 0;
+		int64_t gpr[32] = {0};
+		while(!input.end())
+		{
+			pc += reader.readvs();
+			string line = {"0x", hex<8>(pc)};
+			if(registers)
+			{
+				unsigned changed = input.read();
+				for (unsigned i = 0; i < changed; i++)
+				{
+					unsigned index = input.read() & 31;
+					gpr[index] = (uint64_t)gpr[index]+unzigzag(reader.readvu());
+					line.append(" ", gprnames[index], "=", hex<16>(gpr[index]));
+				}
+			}
+			output.print(line, "\n");
+		}
+		return true;
+	}
+};
+
+void dbg_vi ()
+{
+	frametiming.vi();
+}
+
+void dbg_update ( unsigned int pc )
+{
+	tracer.record(pc);
+	if(commandbatch.active)
+	{
+		commandbatch.update(pc);
+		return;
+	}
+	// a stop on an exec breakpoint whose condition is false is resumed straight away, but a single step
+	// that lands on one stays a single step
+	if(breakpoints.stepping.exchange(false))
+		return;
+	// the core only waits for a DebugStep after this callback if the run state is still 0, so setting it
+	// back to 2 here is enough to resume
+	if(API::DebugGetState(M64P_DBG_RUN_STATE) == 0 and breakpoints.match(pc) == BreakpointIndex::Match::Skip)
+		API::DebugSetRunState(2);
+}
+
+// Cheat-style RAM search. Each pass copies RDRAM once, then splits the scan across worker threads;
+// after the first narrowing pass only the surviving offsets (kept sorted) are looked at again.
+struct RamSearch
+{
+	enum class Size : unsigned { Byte, Half, Word, Float };
+	enum class Compare : unsigned { Equal, NotEqual, Changed, Unchanged, Increased, Decreased };
+	
+	Size size;
+	Compare compare;
+	Uint32 value;
+	float fvalue;
+	
+	Uint8 * current;
+	Uint8 * previous;
+	bool all; // every aligned offset is still a candidate; candidates is empty
+	std::vector<Uint32> candidates;
+	
+	struct Task
+	{
+		RamSearch * search;
+		unsigned begin;
+		unsigned end;
+		std::vector<Uint32> results;
+	};
+	static int worker(void * ptr);
+	template<typename T> bool test(T now, T before, T target) const;
+	template<typename T> void scan(Task & task) const;
+	template<typename T> T at(const Uint8 * ram, Uint32 offset) const;
+	unsigned width() const;
+	
+	bool snapshot();
+	void reset();
+	bool refine();
+	unsigned count() const;
+	Uint32 offset(unsigned index) const;
+	
+	RamSearch() : size(Size::Word), compare(Compare::Equal), value(0), fvalue(0), current(NULL), previous(NULL), all(true) {}
+};
+
+struct SearchWindow : Window
+{
+	FixedLayout layout;
+	ComboButton size;
+	ComboButton compare;
+	LineEdit value;
+	Button btn_new;
+	Button btn_search;
+	Label status;
+	ListView results;
+	RamSearch search;
+	void refresh();
+	SearchWindow();
+};
+
+// Register view. The core's register pointers are resolved once when the debugger attaches and read
+// directly afterwards; only list rows whose value changed since the last refresh are rewritten.
+struct RegistersWindow : Window
+{
+	FixedLayout layout;
+	ListView list;
+	Button btn_step;
+	Timer timer;
+	
+	int64_t * gpr; // stable for the session; the PC pointer isn't and is looked up on each refresh
+	int64_t * hi;
+	int64_t * lo;
+	Uint32 * cop0;
+	int64_t * fgr;
+	
+	static const unsigned count = 3+32+32+32;
+	uint64_t values[count];
+	bool known;
+	
+	bool attach();
+	void detach();
+	void refresh();
+	RegistersWindow();
+};
+
+struct CommandWindow : Window
+{
+	FixedLayout layout;
+	TextEdit output;
+	LineEdit input;
+	Timer timer;
+	string history;
+	void print(const string & text);
+	void execute(string command);
+	void start(unsigned limit, bool logging);
+	CommandWindow();
+};
+
+struct BreakpointWindow : Window
+{
+	FixedLayout layout;
+	LineEdit range;
+	CheckButton read;
+	CheckButton write;
+	CheckButton exec;
+	LineEdit condition;
+	Button btn_add;
+	Button btn_remove;
+	ListView list;
+	Timer timer;
+	void refresh();
+	BreakpointWindow();
+};
+
+struct TraceWindow : Window
+{
+	FixedLayout layout;
+	LineEdit filename;
+	CheckButton registers;
+	Button btn_record;
+	Button btn_export;
+	Label status;
+	Timer timer;
+	TraceWindow();
+};
+
+struct ProfilerWindow : Window
+{
+	FixedLayout layout;
+	ComboButton source;
+	LineEdit rate;
+	ComboButton grouping;
+	Button btn_start;
+	Button btn_reset;
+	Label status;
+	ListView list;
+	Timer timer;
+	std::map<Uint32, Uint32> functions; // sampled address -> guessed function start
+	Uint32 function(Uint32 address);
+	void refresh();
+	ProfilerWindow();
+};
+
+// Disassembly pane. Only the visible rows are decoded, and decoded text is cached per address; an entry
+// is reused as long as the instruction word at that address (and, when shown, the dynarec's block count)
+// hasn't changed, so self-modifying or reloaded code still gets redecoded.
+struct DisassemblyWindow : Window
+{
+	FixedLayout layout;
+	LineEdit address;
+	Button btn_pc;
+	CheckButton recompiled;
+	ListView list;
+	VerticalScroller scroller;
+	Timer timer;
+	
+	static const unsigned rows = 32;
+	struct Entry
+	{
+		Uint32 word;
+		int blocks; // M64P_DBG_MEM_NUM_RECOMPILED when host was filled in, -1 otherwise
+		string text;
+		string host;
+	};
+	std::unordered_map<Uint32, Entry> cache;
+	Uint32 top;
+	lstring shown[rows];
+	
+	void show(Uint32 address);
+	void refresh();
+	DisassemblyWindow();
+};
+
+struct Debugger : Window
+{
+    FixedLayout layout;
+    Button btn_memory;
+    Button btn_registers;
+    Button btn_search;
+    Button btn_commands;
+    Button btn_breakpoints;
+    Button btn_trace;
+    Button btn_profiler;
+    Button btn_disassembly;
+	bool visible;
+    MainWindow * parent;
+    Debugger(MainWindow * arg_parent);
+	MemoryWindow win_memory;
+	SearchWindow win_search;
+	RegistersWindow win_registers;
+	CommandWindow win_commands;
+	BreakpointWindow win_breakpoints;
+	TraceWindow win_trace;
+	ProfilerWindow win_profiler;
+	DisassemblyWindow win_disassembly;
+};
+
+struct Options : Window
+{
+    FixedLayout layout;
+    Button btn_apply;
+    CheckButton timinglog;
+    CheckButton rewind;
+    CheckButton dedupe;
+    MainWindow * parent;
+    Options(MainWindow * arg_parent);
+    unsigned short config_height;
+    unsigned short config_width;
+};
+
+struct MainWindow : Window
+{
+    FixedLayout layout;
+    Button btn_load;
+    Button btn_options;
+    Button btn_library;
+    Button btn_save;
+    Button btn_restore;
+    Button btn_slots;
+    Button btn_record;
+    Button btn_pauser;
+    image img_pause;
+    image img_play;
+    Options * win_options;
+	Debugger * win_debugger;
+    LibraryWindow * win_library;
+    SlotWindow * win_slots;
+    string libraryrom; // picked from the library; romscript uses it instead of asking the browser
+    bool paused;
+    BrowserWindow browser;
+    Timer uitimer;
+    Label timing;
+    Timer timingtimer;
+    file timinglog;
+    MainWindow();
+    nall::function<void()> do_play;
+    nall::function<void()> do_pause;
+    nall::function<void()> do_loadrom;
+    nall::function<void()> do_stop;
+};
+
+MemoryWindow::MemoryWindow()
+{
+	setTitle("Memory");
+	
+	invalidate();
+	livevalid = false;
+	
+	auto update = [this]()
+	{
+		if(this->address.text().length() <= 8 or (this->address.text().beginsWith("0x") and this->address.text().length() <= 10))
+			inputnum = hex(this->address.text());
+		else
+		{
+			puts("UI: Invalid address input in memory viewer.");
+			return;
+		}
+		inputnum = inputnum/columns*columns;
+		
+		invalidate();
+		livememory.address = inputnum;
+		display.setOffset(inputnum);
+	};
+	display.setColumns(columns);
+	display.setRows(rows);
+	display.setLength(0xFFFFFFFF);
+	display.onRead = [this](unsigned offset) -> uint8_t
+	{
+		return readbyte(offset);
+	};
+	display.onWrite = [this](unsigned offset, uint8_t data)
+	{
+		API::DebugMemWrite8(offset, data);
+		invalidate();
+	};
+	live.setText("Live");
+	live.onToggle = [this]()
+	{
+		livevalid = false;
+		livememory.address = display.offset();
+		livememory.enabled = live.checked();
+		timer.setEnabled(live.checked());
+		status.setText("");
+	};
+	timer.setInterval(33);
+	timer.onActivate = [this]()
+	{
+		livememory.address = display.offset();
+		Uint32 snapshot_address;
+		Uint32 * snapshot = livememory.fetch(&snapshot_address);
+		if(!snapshot)
+			return;
+		
+		unsigned changed = 0;
+		bool sameview = livevalid and snapshot_address == liveaddress;
+		if(sameview)
+		{
+			for (unsigned row = 0; row < rows; row++)
+				if(memcmp(snapshot+row*columns/4, livewords+row*columns/4, columns) != 0)
+					changed++;
+		}
+		memcpy(livewords, snapshot, sizeof(livewords));
+		liveaddress = snapshot_address;
+		livevalid = true;
+		
+		status.setText(changed ? string{changed, " rows changed"} : string{""});
+		if(changed or !sameview)
+			display.update();
+	};
+	auto font = Font::monospace(10);
+	display.setFont(font);
+	address.setFont(font);
+	address.setText("0x80000000");
+	address.onChange = update;
+	
+	auto prefixsize = Font::size(font, "0x");
+	auto wordsize = Font::size(font, "12345678");
+	auto linesize = Font::size(font, "12345678  00 11 22 33 44 55 66 77 88 99 AA BB CC DD EE FF  0123456789ABCDEF");
+	auto livesize = Font::size(font, "Live");
+	auto statussize = Font::size(font, "32 rows changed");
+	
+	auto viewwidth = linesize.width+6+24;
+	auto entrywidth = wordsize.width+prefixsize.width+6;
+	auto entryheight = wordsize.height+6;
+	auto viewheight = wordsize.height*rows+6;
+	
+	setGeometry({64, 256, viewwidth+20, entryheight + 30 + viewheight});
+	
+	layout.append(address, Geometry{10, 10, entrywidth, entryheight});
+	layout.append(live, Geometry{10+entrywidth+10, 10, livesize.width+32, entryheight});
+	layout.append(status, Geometry{10+entrywidth+10+livesize.width+32+10, 10, statussize.width, entryheight});
+	layout.append(display, Geometry{10, entryheight+20, viewwidth, viewheight});
+	append(layout);
+	
+	display.setOffset(0x80000000);
+	
+	setVisible(false);
+}
+
+void MemoryWindow::invalidate()
+{
+	for (auto & page : pages)
+		page.valid = false;
+	clock = 0;
+}
+
+Uint8 MemoryWindow::readbyte(Uint32 address)
+{
+	Uint32 word;
+	if(live.checked() and livevalid and address-liveaddress < rows*columns)
+		word = livewords[(address-liveaddress)/4];
+	else
+	{
+		Uint32 now = SDL_GetTicks();
+		Uint32 number = address >> 12;
+		Page * page = NULL;
+		for (auto & candidate : pages)
+		{
+			if(candidate.valid and candidate.number == number)
+				page = &candidate;
+		}
+		if(!page or now-page->loaded >= maxage)
+		{
+			if(!page)
+			{
+				page = &pages[0];
+				for (auto & candidate : pages)
+				{
+					if(!candidate.valid or candidate.used < page->used)
+						page = &candidate;
+					if(!candidate.valid)
+						break;
+				}
+			}
+			page->number = number;
+			page->valid = true;
+			page->loaded = now;
+			memset(page->known, 0, sizeof(page->known));
+			if(Memory::rdramoffset(number << 12) < Memory::rdramsize)
+			{
+				Memory::read32(number << 12, page->words, 0x1000/4);
+				memset(page->known, 0xFF, sizeof(page->known));
+			}
+		}
+		page->used = ++clock;
+		
+		unsigned index = (address & 0xFFF)/4;
+		if(!(page->known[index/32] & (1u << (index%32))))
+		{
+			page->words[index] = API::DebugMemRead32(address & ~3u);
+			page->known[index/32] |= 1u << (index%32);
+		}
+		word = page->words[index];
+	}
+	// the core keeps words in host order; the N64 is big-endian
+	return word >> ((3-(address & 3))*8);
+}
+
+unsigned RamSearch::width() const
+{
+	return size == Size::Byte ? 1 : size == Size::Half ? 2 : 4;
+}
+
+// RDRAM is stored as host-order words, so sub-word N64 addresses are swizzled on little-endian hosts
+template<typename T> T RamSearch::at(const Uint8 * ram, Uint32 offset) const
+{
+	T result;
+	if(sizeof(T) == 1)
+		offset ^= 3;
+	else if(sizeof(T) == 2)
+		offset ^= 2;
+	memcpy(&result, ram+offset, sizeof(T));
+	return result;
+}
+
+template<typename T> bool RamSearch::test(T now, T before, T target) const
+{
+	switch(compare)
+	{
+	case Compare::Equal: return now == target;
+	case Compare::NotEqual: return now != target;
+	case Compare::Changed: return now != before;
+	case Compare::Unchanged: return now == before;
+	case Compare::Increased: return now > before;
+	case Compare::Decreased: return now < before;
+	}
+	return false;
+}
+
+template<typename T> void RamSearch::scan(Task & task) const
+{
+	T target;
+	if(size == Size::Float)
+		memcpy(&target, &fvalue, sizeof(T));
+	else
+		target = (T)value;
+	
+	if(!all)
+	{
+		for (unsigned i = task.begin; i < task.end; i++)
+		{
+			Uint32 offset = candidates[i];
+			if(test<T>(at<T>(current, offset), at<T>(previous, offset), target))
+				task.results.push_back(offset);
+		}
+		return;
+	}
+	
+	// Full pass: work a word at a time and skip whole words that can't match. For equality the
+	// XOR against the splatted target has a zero lane exactly where a lane matches (the usual SWAR
+	// zero-lane test); for changed/unchanged the XOR against the previous word plays the same role.
+	const Uint32 * now = (const Uint32 *)current;
+	const Uint32 * before = (const Uint32 *)previous;
+	const Uint32 lanes = sizeof(T) == 1 ? 0x01010101 : sizeof(T) == 2 ? 0x00010001 : 1;
+	const Uint32 highs = lanes << (sizeof(T)*8-1);
+	const Uint32 splat = sizeof(T) < 4 ? (Uint32)target*lanes : 0;
+	for (unsigned i = task.begin; i < task.end; i++)
+	{
+		if(sizeof(T) < 4)
+		{
+			Uint32 x = now[i] ^ (compare == Compare::Equal ? splat : before[i]);
+			bool zerolane = ((x - lanes) & ~x & highs) != 0;
+			if((compare == Compare::Equal or compare == Compare::Unchanged) and !zerolane)
+				continue;
+			if(compare == Compare::Changed and x == 0)
+				continue;
+		}
+		for (Uint32 offset = i*4; offset < i*4+4; offset += sizeof(T))
+		{
+			if(test<T>(at<T>(current, offset), at<T>(previous, offset), target))
+				task.results.push_back(offset);
+		}
+	}
+}
+
+int RamSearch::worker(void * ptr)
+{
+	Task & task = *(Task *)ptr;
+	switch(task.search->size)
+	{
+	case Size::Byte: task.search->scan<Uint8>(task); break;
+	case Size::Half: task.search->scan<uint16_t>(task); break;
+	case Size::Word: task.search->scan<Uint32>(task); break;
+	case Size::Float: task.search->scan<float>(task); break;
+	}
+	return 0;
+}
+
+bool RamSearch::snapshot()
+{
+	Uint8 * rdram = (Uint8 *)API::DebugMemGetPointer(M64P_DBG_PTR_RDRAM);
+	if(!rdram)
+		return false;
+	if(!current)
+	{
+		current = (Uint8 *)malloc(Memory::rdramsize);
+		previous = (Uint8 *)malloc(Memory::rdramsize);
+		// the first search then compares against RAM as it is now rather than against uninitialized memory
+		memcpy(current, rdram, Memory::rdramsize);
+	}
+	std::swap(current, previous);
+	memcpy(current, rdram, Memory::rdramsize);
+	return true;
+}
+
+void RamSearch::reset()
+{
+	all = true;
+	candidates.clear();
+	candidates.shrink_to_fit();
+	if(snapshot())
+		memcpy(previous, current, Memory::rdramsize);
+}
+
+bool RamSearch::refine()
+{
+	if(!snapshot())
+		return false;
+	
+	unsigned total = all ? Memory::rdramsize/4 : candidates.size();
+	unsigned threads = max(1, min(16, SDL_GetCPUCount()));
+	if(total < 0x10000)
+		threads = 1;
+	
+	std::vector<Task> tasks(threads);
+	std::vector<SDL_Thread *> handles(threads);
+	for (unsigned i = 0; i < threads; i++)
+	{
+		tasks[i].search = this;
+		tasks[i].begin = (uint64_t)total*i/threads;
+		tasks[i].end = (uint64_t)total*(i+1)/threads;
+		// the last task runs here instead of on a new thread
+		handles[i] = i+1 < threads ? SDL_CreateThread(worker, "RamSearch", &tasks[i]) : NULL;
+		if(!handles[i])
+			worker(&tasks[i]);
+	}
+	
+	// tasks cover ascending ranges, so concatenating their results keeps the offsets sorted
+	std::vector<Uint32> survivors;
+	unsigned found = 0;
+	for (unsigned i = 0; i < threads; i++)
+	{
+		if(handles[i])
+			SDL_WaitThread(handles[i], NULL);
+		found += tasks[i].results.size();
+	}
+	survivors.reserve(found);
+	for (auto & task : tasks)
+		survivors.insert(survivors.end(), task.results.begin(), task.results.end());
+	
+	candidates.swap(survivors);
+	all = false;
+	return true;
+}
+
+unsigned RamSearch::count() const
+{
+	return all ? Memory::rdramsize/width() : candidates.size();
+}
+
+Uint32 RamSearch::offset(unsigned index) const
+{
+	return all ? index*width() : candidates[index];
+}
+
+SearchWindow::SearchWindow()
+{
+	setTitle("Search");
+	
+	size.append("8-bit");
+	size.append("16-bit");
+	size.append("32-bit");
+	size.append("Float");
+	size.setSelection(2);
+	compare.append("Equal to");
+	compare.append("Not equal to");
+	compare.append("Changed");
+	compare.append("Unchanged");
+	compare.append("Increased");
+	compare.append("Decreased");
+	value.setText("0");
+	
+	results.setHeaderText({"Address", "Value", "Previous"});
+	results.setHeaderVisible();
+	
+	btn_new.setText("New");
+	btn_new.onActivate = [this]()
+	{
+		search.size = (RamSearch::Size)size.selection();
+		search.reset();
+		refresh();
+	};
+	btn_search.setText("Search");
+	btn_search.onActivate = [this]()
+	{
+		if(search.size != (RamSearch::Size)size.selection())
+		{
+			search.size = (RamSearch::Size)size.selection();
+			search.reset();
+		}
+		search.compare = (RamSearch::Compare)compare.selection();
+		string text = value.text();
+		if(search.size == RamSearch::Size::Float)
+			search.fvalue = real(text);
+		else if(text.beginsWith("0x"))
+			search.value = hex(text);
+		else
+			search.value = integer(text);
+		
+		auto time = SDL_GetTicks();
+		if(!search.refine())
+			std::cout << "UI: Search: Core did not give a pointer to RDRAM.\n";
+		std::cout << "UI: Search: Pass took " << SDL_GetTicks()-time << "ms.\n";
+		refresh();
+	};
+	
+	layout.append(size,       Geometry{10     , 10     , 64 , 24});
+	layout.append(compare,    Geometry{10+64+4, 10     , 96 , 24});
+	layout.append(value,      Geometry{10+164+4, 10    , 96 , 24});
+	layout.append(btn_new,    Geometry{10     , 10+24+4, 64 , 24});
+	layout.append(btn_search, Geometry{10+64+4, 10+24+4, 64 , 24});
+	layout.append(status,     Geometry{10+136+4, 10+24+4, 128, 24});
+	layout.append(results,    Geometry{10     , 10+(24+4)*2, 264+4, 300});
+	append(layout);
+	
+	setGeometry({64, 256, 10+268+10, 10+(24+4)*2+300+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+// Only the first few hundred candidates are listed; the rest are just counted
+void SearchWindow::refresh()
+{
+	status.setText({search.count(), " candidates"});
+	results.reset();
+	if(!search.current or search.all)
+		return;
+	unsigned shown = min(search.count(), 256u);
+	for (unsigned i = 0; i < shown; i++)
+	{
+		Uint32 offset = search.offset(i);
+		string now, before;
+		switch(search.size)
+		{
+		case RamSearch::Size::Byte:
+			now = hex<2>(search.at<Uint8>(search.current, offset));
+			before = hex<2>(search.at<Uint8>(search.previous, offset));
+			break;
+		case RamSearch::Size::Half:
+			now = hex<4>(search.at<uint16_t>(search.current, offset));
+			before = hex<4>(search.at<uint16_t>(search.previous, offset));
+			break;
+		case RamSearch::Size::Word:
+			now = hex<8>(search.at<Uint32>(search.current, offset));
+			before = hex<8>(search.at<Uint32>(search.previous, offset));
+			break;
+		case RamSearch::Size::Float:
+			now = search.at<float>(search.current, offset);
+			before = search.at<float>(search.previous, offset);
+			break;
+		}
+		results.append({hex<8>(0x80000000 | offset), now, before});
+	}
+	results.autoSizeColumns();
+}
+
+RegistersWindow::RegistersWindow()
+{
+	setTitle("Registers");
+	detach();
+	
+	static const char * cop0names[32] = {
+		"Index", "Random", "EntryLo0", "EntryLo1", "Context", "PageMask", "Wired", "cop0 7",
+		"BadVAddr", "Count", "EntryHi", "Compare", "Status", "Cause", "EPC", "PRevID",
+		"Config", "LLAddr", "WatchLo", "WatchHi", "XContext", "cop0 21", "cop0 22", "cop0 23",
+		"cop0 24", "cop0 25", "PErr", "CacheErr", "TagLo", "TagHi", "ErrorEPC", "cop0 31"
+	};
+	
+	list.setHeaderText({"Register", "Value"});
+	list.setHeaderVisible();
+	list.append({"pc", ""});
+	list.append({"hi", ""});
+	list.append({"lo", ""});
+	for (unsigned i = 0; i < 32; i++)
+		list.append({gprnames[i], ""});
+	for (unsigned i = 0; i < 32; i++)
+		list.append({cop0names[i], ""});
+	for (unsigned i = 0; i < 32; i++)
+		list.append({string{"f", i}, ""});
+	
+	btn_step.setText("Step");
+	btn_step.onActivate = [this]()
+	{
+		breakpoints.stepping = API::DebugGetState(M64P_DBG_RUN_STATE) == 0;
+		if(API::DebugStep() != M64ERR_SUCCESS)
+			std::cout << "UI: Registers: Core refused to step.\n";
+	};
+	
+	timer.setInterval(50);
+	timer.onActivate = [this]()
+	{
+		refresh();
+	};
+	onClose = [this]()
+	{
+		timer.setEnabled(false);
+		setVisible(false);
+	};
+	
+	auto font = Font::monospace(10);
+	list.setFont(font);
+	auto rowsize = Font::size(font, "ErrorEPC  0123456789ABCDEF");
+	
+	layout.append(btn_step, Geometry{10, 10, 64, 24});
+	layout.append(list, Geometry{10, 10+24+4, rowsize.width+48, 400});
+	append(layout);
+	
+	setGeometry({256, 64, rowsize.width+48+20, 10+24+4+400+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+bool RegistersWindow::attach()
+{
+	gpr = (int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_REG);
+	hi = (int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_HI);
+	lo = (int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_LO);
+	cop0 = (Uint32 *)API::DebugGetCPUDataPtr(M64P_CPU_REG_COP0);
+	fgr = (int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_COP1_FGR_64);
+	known = false;
+	if(!API::DebugGetCPUDataPtr(M64P_CPU_PC) or !gpr or !hi or !lo or !cop0 or !fgr)
+	{
+		detach();
+		return false;
+	}
+	return true;
+}
+
+void RegistersWindow::detach()
+{
+	gpr = hi = lo = fgr = NULL;
+	cop0 = NULL;
+	known = false;
+}
+
+void RegistersWindow::refresh()
+{
+	if(!gpr and !attach())
+		return;
+	// &PC->addr of whichever instruction is current, so it changes as the CPU runs
+	Uint32 * pc = (Uint32 *)API::DebugGetCPUDataPtr(M64P_CPU_PC);
+	if(!pc)
+		return;
+	
+	uint64_t now[count];
+	now[0] = *pc;
+	now[1] = *hi;
+	now[2] = *lo;
+	for (unsigned i = 0; i < 32; i++)
+	{
+		now[3+i] = gpr[i];
+		now[3+32+i] = cop0[i];
+		now[3+64+i] = fgr[i];
+	}
+	
+	for (unsigned i = 0; i < count; i++)
+	{
+		if(known and now[i] == values[i])
+			continue;
+		bool narrow = i == 0 or (i >= 3+32 and i < 3+64);
+		list.setText(i, 1, narrow ? hex<8>(now[i]) : hex<16>(now[i]));
+		values[i] = now[i];
+	}
+	known = true;
+}
+
+CommandWindow::CommandWindow()
+{
+	setTitle("Commands");
+	
+	auto font = Font::monospace(10);
+	output.setFont(font);
+	output.setEditable(false);
+	input.setFont(font);
+	input.onActivate = [this]()
+	{
+		string command = input.text();
+		input.setText("");
+		print({"> ", command});
+		execute(command);
+	};
+	
+	timer.setInterval(10);
+	timer.onActivate = [this]()
+	{
+		if(!commandbatch.finished)
+			return;
+		commandbatch.finished = false;
+		timer.setEnabled(false);
+		
+		if(commandbatch.logging)
+		{
+			string text;
+			for (auto pc : commandbatch.log)
+				text.append(hex<8>(pc), "\n");
+			print(text.rtrim<1>("\n"));
+			if(commandbatch.steps > commandbatch.log.size())
+				print({"Only the first ", commandbatch.log.size(), " steps were logged."});
+		}
+		print({"Stopped at 0x", hex<8>(commandbatch.lastpc), " after ", commandbatch.steps, " steps."});
+		commandbatch.log.clear();
+		commandbatch.log.shrink_to_fit();
+	};
+	
+	layout.append(output, Geometry{10, 10, 480, 320});
+	layout.append(input, Geometry{10, 10+320+4, 480, 24});
+	append(layout);
+	
+	setGeometry({256, 256, 500, 10+320+4+24+10});
+	setResizable(false);
+	setVisible(false);
+	print("Commands: step N [log], run until EXPR, stop, read ADDR [COUNT], write ADDR VALUE, bp add ADDR, dump START END FILE");
+}
+
+void CommandWindow::print(const string & text)
+{
+	history.append(text, "\n");
+	// keep the log from growing without bound
+	if(history.length() > 0x40000)
+		history = substr(history, history.length()-0x20000);
+	output.setText(history);
+	output.setCursorPosition(~0);
+}
+
+void CommandWindow::start(unsigned limit, bool logging)
+{
+	commandbatch.limit = limit;
+	commandbatch.steps = 0;
+	commandbatch.logging = logging;
+	commandbatch.log.clear();
+	// the core thread never grows the log, so this caps it too; a longer run only logs its first steps
+	if(logging)
+		commandbatch.log.reserve(limit ? min(limit, 0x100000u) : 0x100000u);
+	commandbatch.gpr = (const int64_t *)API::DebugGetCPUDataPtr(M64P_CPU_REG_REG);
+	commandbatch.finished = false;
+	commandbatch.cancelled = false;
+	commandbatch.active = true;
+	timer.setEnabled(true);
+	
+	// a core blocked in the update callback needs one DebugStep to pick the new run state up
+	bool blocked = API::DebugGetState(M64P_DBG_RUN_STATE) == 0;
+	API::DebugSetRunState(1);
+	if(blocked)
+		API::DebugStep();
+}
+
+void CommandWindow::execute(string command)
+{
+	lstring words = command.strip().split(" ");
+	if(words.size() == 0 or words[0] == "")
+		return;
+	auto state = controller.get();
+	bool emulating = state == CoreController::State::Running or state == CoreController::State::Paused;
+	if(words[0] == "stop")
+	{
+		if(!commandbatch.active)
+			print("No batch is running.");
+		else if(state == CoreController::State::Running)
+			commandbatch.cancelled = true;
+		else
+		{
+			// no instructions are running, so the update callback won't end it
+			commandbatch.active = false;
+			if(emulating)
+				API::DebugSetRunState(0);
+			commandbatch.finished = true;
+		}
+		return;
+	}
+	if(commandbatch.active)
+	{
+		print("A batch is still running; \"stop\" cancels it.");
+		return;
+	}
+	
+	auto number = [&](unsigned index, int64_t fallback) -> int64_t
+	{
+		if(index >= words.size())
+			return fallback;
+		auto result = Eval::integer(words[index]);
+		if(!result)
+			throw "bad number";
+		return result();
+	};
+	
+	try
+	{
+		if((words[0] == "step" or words[0] == "run") and !emulating)
+			throw "no ROM is running";
+		if(words[0] == "step")
+		{
+			commandbatch.conditional = false;
+			start(max((int64_t)1, number(1, 1)), words.size() > 2 and words[2] == "log");
+		}
+		else if(words[0] == "run" and words.size() > 2 and words[1] == "until")
+		{
+			string expression;
+			for (unsigned i = 2; i < words.size(); i++)
+				expression.append(words[i], " ");
+			Eval::Node * tree = Eval::parse(expression);
+			try
+			{
+				commandbatch.until = Condition();
+				commandbatch.until.compile(tree);
+			}
+			catch(const char *)
+			{
+				delete tree;
+				throw;
+			}
+			delete tree;
+			commandbatch.conditional = true;
+			start(0, false);
+		}
+		else if(words[0] == "read")
+		{
+			Uint32 address = number(1, 0) & ~3;
+			unsigned count = min(number(2, 1), (int64_t)0x100);
+			string text;
+			for (unsigned i = 0; i < count; i++)
+				text.append(i % 4 == 0 ? string{i ? "\n" : "", "0x", hex<8>(address+i*4), ":"} : string{""},
+				            " ", hex<8>(API::DebugMemRead32(address+i*4)));
+			print(text);
+		}
+		else if(words[0] == "write" and words.size() == 3)
+		{
+			API::DebugMemWrite32(number(1, 0) & ~3, number(2, 0));
+		}
+		else if(words[0] == "bp" and words.size() == 3 and words[1] == "add")
+		{
+			Uint32 address = number(2, 0);
+			if(!breakpoints.add(address, address, M64P_BKP_FLAG_EXEC, ""))
+				print("Too many breakpoints.");
+			else
+				print({"Breakpoint ", breakpoints.list.size()-1, " added."});
+		}
+		else if(words[0] == "dump" and words.size() == 4)
+		{
+			Uint32 begin = number(1, 0) & ~3;
+			Uint32 end = number(2, 0);
+			if(end <= begin or end-begin > 0x4000000)
+				throw "bad range";
+			unsigned count = (end-begin+3)/4;
+			std::vector<Uint32> buffer(count);
+			Memory::read32(begin, buffer.data(), count);
+			// written in N64 (big-endian) byte order
+			std::vector<uint8_t> bytes(count*4);
+			for (unsigned i = 0; i < count; i++)
+			{
+				bytes[i*4+0] = buffer[i] >> 24;
+				bytes[i*4+1] = buffer[i] >> 16;
+				bytes[i*4+2] = buffer[i] >> 8;
+				bytes[i*4+3] = buffer[i];
+			}
+			if(!file::write(words[3], bytes.data(), end-begin))
+				print("Could not write dump.");
+		}
+		else
+			print("Unknown command.");
+	}
+	catch(const char * error)
+	{
+		print({"Error: ", error});
+	}
+}
+
+BreakpointWindow::BreakpointWindow()
+{
+	setTitle("Breakpoints");
+	
+	range.setText("0x80000000");
+	read.setText("Read");
+	write.setText("Write");
+	exec.setText("Exec");
+	exec.setChecked();
+	
+	list.setHeaderText({"Range", "Type", "Condition", "Hits"});
+	list.setHeaderVisible();
+	list.setCheckable();
+	list.onToggle = [this](unsigned row)
+	{
+		breakpoints.enable(row, list.checked(row));
+	};
+	
+	btn_add.setText("Add");
+	btn_add.onActivate = [this]()
+	{
+		lstring bounds = range.text().split<1>("-");
+		Uint32 begin = hex(bounds[0].strip());
+		Uint32 end = bounds.size() > 1 ? (Uint32)hex(bounds[1].strip()) : begin;
+		Uint32 flags = (read.checked() ? M64P_BKP_FLAG_READ : 0)
+		             | (write.checked() ? M64P_BKP_FLAG_WRITE : 0)
+		             | (exec.checked() ? M64P_BKP_FLAG_EXEC : 0);
+		if(!flags or end < begin)
+			return;
+		try
+		{
+			if(!breakpoints.add(begin, end, flags, condition.text()))
+			{
+				std::cout << "UI: Breakpoints: The core only holds " << BREAKPOINTS_MAX_NUMBER << " breakpoints.\n";
+				return;
+			}
+		}
+		catch(const char * error)
+		{
+			std::cout << "UI: Breakpoints: Bad condition: " << error << "\n";
+			return;
+		}
+		refresh();
+	};
+	btn_remove.setText("Remove");
+	btn_remove.onActivate = [this]()
+	{
+		if(!list.selected())
+			return;
+		unsigned row = list.selection();
+		breakpoints.remove(row);
+		list.remove(row);
+	};
+	
+	timer.setInterval(250);
+	timer.onActivate = [this]()
+	{
+		refresh();
+	};
+	onClose = [this]()
+	{
+		timer.setEnabled(false);
+		setVisible(false);
+	};
+	
+	layout.append(range,      Geometry{10            , 10         , 160, 24});
+	layout.append(read,       Geometry{10+160+4      , 10         , 56 , 24});
+	layout.append(write,      Geometry{10+160+4+60   , 10         , 56 , 24});
+	layout.append(exec,       Geometry{10+160+4+120  , 10         , 56 , 24});
+	layout.append(condition,  Geometry{10            , 10+24+4    , 160, 24});
+	layout.append(btn_add,    Geometry{10+160+4      , 10+24+4    , 56 , 24});
+	layout.append(btn_remove, Geometry{10+160+4+60   , 10+24+4    , 56 , 24});
+	layout.append(list,       Geometry{10            , 10+(24+4)*2, 340, 240});
+	append(layout);
+	
+	setGeometry({256, 128, 360, 10+(24+4)*2+240+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+// Rows are rebuilt when the console added or removed breakpoints behind the window's back
+void BreakpointWindow::refresh()
+{
+	if(list.rows() != breakpoints.list.size())
+	{
+		list.reset();
+		for (auto & breakpoint : breakpoints.list)
+		{
+			Uint32 flags = breakpoint.flags;
+			list.append({
+				breakpoint.begin == breakpoint.end ? string{"0x", hex<8>(breakpoint.begin)} : string{"0x", hex<8>(breakpoint.begin), "-0x", hex<8>(breakpoint.end)},
+				string{flags & M64P_BKP_FLAG_READ ? "R" : "", flags & M64P_BKP_FLAG_WRITE ? "W" : "", flags & M64P_BKP_FLAG_EXEC ? "X" : ""},
+				breakpoint.condition,
+				""
+			});
+			list.setChecked(list.rows()-1, flags & M64P_BKP_FLAG_ENABLED);
+		}
+		list.autoSizeColumns();
+	}
+	for (unsigned i = 0; i < list.rows() and i < breakpoints.list.size(); i++)
+	{
+		string hits = breakpoints.hits[i].load();
+		if(list.text(i, 3) != hits)
+			list.setText(i, 3, hits);
+	}
+}
+
+TraceWindow::TraceWindow()
+{
+	setTitle("Trace");
+	
+	filename.setText("trace.bin");
+	registers.setText("Registers");
+	btn_record.setText("Record");
+	btn_record.onActivate = [this]()
+	{
+		if(tracer.writer)
+		{
+			tracer.stop();
+			timer.setEnabled(false);
+			timer.onActivate();
+			btn_record.setText("Record");
+			return;
+		}
+		if(!tracer.start(filename.text(), registers.checked()))
+		{
+			status.setText("Could not start trace.");
+			return;
+		}
+		btn_record.setText("Stop");
+		timer.setEnabled(true);
+	};
+	btn_export.setText("Export text");
+	btn_export.onActivate = [this]()
+	{
+		if(tracer.writer)
+			return;
+		string target = {filename.text(), ".txt"};
+		status.setText(TraceReader::exporttext(filename.text(), target) ? string{"Wrote ", target} : string{"Could not export trace."});
+	};
+	
+	timer.setInterval(250);
+	timer.onActivate = [this]()
+	{
+		status.setText({tracer.records.load(), " records, ", tracer.written.load()/1024, " KB, ", tracer.dropped.load(), " dropped"});
+	};
+	
+	layout.append(filename,   Geometry{10          , 10     , 160, 24});
+	layout.append(registers,  Geometry{10+160+4    , 10     , 80 , 24});
+	layout.append(btn_record, Geometry{10          , 10+24+4, 64 , 24});
+	layout.append(btn_export, Geometry{10+64+4     , 10+24+4, 80 , 24});
+	layout.append(status,     Geometry{10          , 10+(24+4)*2, 244, 24});
+	append(layout);
+	
+	setGeometry({256, 128, 264, 10+(24+4)*2+24+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+ProfilerWindow::ProfilerWindow()
+{
+	setTitle("Profiler");
+	
+	source.append("Sample thread");
+	source.append("Every frame");
+	rate.setText("1000");
+	grouping.append("Addresses");
+	grouping.append("Functions");
+	grouping.onChange = [this]()
+	{
+		refresh();
+	};
+	
+	list.setHeaderText({"Address", "Samples", "%", "Instruction"});
+	list.setHeaderVisible();
+	list.setFont(Font::monospace(10));
+	
+	btn_start.setText("Start");
+	btn_start.onActivate = [this]()
+	{
+		if(profiler.running)
+		{
+			profiler.stop();
+			timer.setEnabled(false);
+			btn_start.setText("Start");
+			refresh();
+			return;
+		}
+		if(!profiler.start(source.selection() == 1, max(1, (int)integer(rate.text()))))
+		{
+			status.setText("Could not start profiler.");
+			return;
+		}
+		btn_start.setText("Stop");
+		timer.setEnabled(true);
+	};
+	btn_reset.setText("Reset");
+	btn_reset.onActivate = [this]()
+	{
+		bool running = profiler.running;
+		profiler.stop();
+		profiler.reset();
+		if(running)
+			profiler.start(profiler.perframe, profiler.rate);
+		refresh();
+	};
+	
+	timer.setInterval(1000);
+	timer.onActivate = [this]()
+	{
+		refresh();
+	};
+	
+	layout.append(source,    Geometry{10          , 10     , 112, 24});
+	layout.append(rate,      Geometry{10+112+4    , 10     , 56 , 24});
+	layout.append(grouping,  Geometry{10+172+4    , 10     , 96 , 24});
+	layout.append(btn_start, Geometry{10          , 10+24+4, 64 , 24});
+	layout.append(btn_reset, Geometry{10+64+4     , 10+24+4, 64 , 24});
+	layout.append(status,    Geometry{10+136+4    , 10+24+4, 200, 24});
+	layout.append(list,      Geometry{10          , 10+(24+4)*2, 400, 300});
+	append(layout);
+	
+	setGeometry({256, 128, 420, 10+(24+4)*2+300+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+// Guesses the start of the function containing address by looking back for the usual
+// "addiu sp, sp, -N" prologue. Results are cached since sampled addresses repeat.
+Uint32 ProfilerWindow::function(Uint32 address)
+{
+	auto cached = functions.find(address);
+	if(cached != functions.end())
+		return cached->second;
+	
+	Uint32 start = address;
+	Uint32 words[256];
+	Uint32 base = address >= 0x400 ? address-0x3FC : 0;
+	unsigned count = (address-base)/4+1;
+	Memory::read32(base, words, count);
+	for (unsigned i = count; i-- > 0;)
+	{
+		if((words[i] & 0xFFFF8000) == 0x27BD8000)
+		{
+			start = base+i*4;
+			break;
+		}
+	}
+	functions[address] = start;
+	return start;
+}
+
+void ProfilerWindow::refresh()
+{
+	struct Row { Uint32 address; Uint32 count; };
+	std::vector<Row> rows;
+	for (unsigned i = 0; i < Profiler::capacity; i++)
+	{
+		Uint32 address = profiler.keys[i].load(std::memory_order_relaxed);
+		if(address)
+			rows.push_back({address, profiler.counts[i].load(std::memory_order_relaxed)});
+	}
+	
+	if(grouping.selection() == 1)
+	{
+		std::map<Uint32, Uint32> grouped;
+		for (auto & row : rows)
+			grouped[function(row.address & ~3u)] += row.count;
+		rows.clear();
+		for (auto & entry : grouped)
+			rows.push_back({entry.first, entry.second});
+	}
+	
+	unsigned shown = min((unsigned)rows.size(), 100u);
+	std::partial_sort(rows.begin(), rows.begin()+shown, rows.end(), [](const Row & a, const Row & b)
+	{
+		return a.count > b.count;
+	});
+	
+	Uint32 total = max(1u, profiler.samples.load());
+	status.setText({profiler.samples.load(), " samples, ", rows.size(), " addresses"});
+	list.reset();
+	for (unsigned i = 0; i < shown; i++)
+	{
+		// in 64 bits: a long session takes a row past the 4.29M samples that count*1000 fits in 32
+		unsigned permille = (Uint64)rows[i].count*1000/total;
+		list.append({
+			string{"0x", hex<8>(rows[i].address)},
+			string{rows[i].count},
+			string{permille/10, ".", permille%10},
+			disassemble(rows[i].address & ~3u)
+		});
+	}
+	list.autoSizeColumns();
+}
+
+DisassemblyWindow::DisassemblyWindow()
+{
+	setTitle("Disassembly");
+	top = 0x80000000;
+	
+	auto font = Font::monospace(10);
+	address.setFont(font);
+	address.setText("0x80000000");
+	address.onActivate = [this]()
+	{
+		show(hex(address.text()));
+	};
+	btn_pc.setText("Go to PC");
+	btn_pc.onActivate = [this]()
+	{
+		Uint32 * pc = (Uint32 *)API::DebugGetCPUDataPtr(M64P_CPU_PC);
+		if(pc)
+			show(*pc);
+	};
+	recompiled.setText("Host code");
+	recompiled.onToggle = [this]()
+	{
+		refresh();
+	};
+	
+	list.setFont(font);
+	list.setHeaderText({"Address", "Word", "Instruction", "Host"});
+	list.setHeaderVisible();
+	for (unsigned i = 0; i < rows; i++)
+		list.append({"", "", "", ""});
+	
+	scroller.setLength(0x40000000);
+	scroller.onChange = [this]()
+	{
+		top = scroller.position()*4;
+		refresh();
+	};
+	
+	timer.setInterval(250);
+	timer.onActivate = [this]()
+	{
+		refresh();
+	};
+	onClose = [this]()
+	{
+		timer.setEnabled(false);
+		setVisible(false);
+	};
+	
+	auto rowsize = Font::size(font, "0x80000000  00000000  addiu   sp, sp, 0xFFE8  12 ops @ 0x12345678");
+	
+	layout.append(address,    Geometry{10          , 10     , 96 , 24});
+	layout.append(btn_pc,     Geometry{10+96+4     , 10     , 64 , 24});
+	layout.append(recompiled, Geometry{10+164+4    , 10     , 96 , 24});
+	layout.append(list,       Geometry{10          , 10+24+4, rowsize.width+48, rowsize.height*rows+48});
+	layout.append(scroller,   Geometry{10+rowsize.width+48, 10+24+4, 18, rowsize.height*rows+48});
+	append(layout);
+	
+	setGeometry({256, 64, rowsize.width+48+18+20, 10+24+4+rowsize.height*rows+48+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+void DisassemblyWindow::show(Uint32 address)
+{
+	top = address & ~3u;
+	scroller.setPosition(top/4);
+	refresh();
+}
+
+void DisassemblyWindow::refresh()
+{
+	Uint32 words[rows];
+	Memory::read32(top, words, rows);
+	Uint32 * pc = (Uint32 *)API::DebugGetCPUDataPtr(M64P_CPU_PC);
+	bool host = recompiled.checked();
+	
+	if(cache.size() > 0x10000)
+		cache.clear();
+	
+	for (unsigned i = 0; i < rows; i++)
+	{
+		Uint32 current = top+i*4;
+		Entry & entry = cache[current];
+		bool stale = entry.text == "" or entry.word != words[i];
+		if(stale)
+		{
+			char op[64], args[64];
+			op[0] = args[0] = 0;
+			API::DebugDecodeOp(words[i], op, args, current);
+			entry.word = words[i];
+			entry.text = {op, " ", args};
+			entry.blocks = -1;
+		}
+		if(host)
+		{
+			int blocks = API::DebugMemGetMemInfo(M64P_DBG_MEM_HAS_RECOMPILED, current) ? API::DebugMemGetMemInfo(M64P_DBG_MEM_NUM_RECOMPILED, current) : 0;
+			if(blocks != entry.blocks)
+			{
+				entry.blocks = blocks;
+				entry.host = "";
+				if(blocks > 0)
+					entry.host = {blocks, " ops @ 0x", hex<8>((uintptr_t)API::DebugMemGetRecompInfo(M64P_DBG_RECOMP_ADDR, current, 0))};
+			}
+		}
+		
+		lstring row = {
+			string{pc and *pc == current ? "> " : "  ", "0x", hex<8>(current)},
+			hex<8>(words[i]),
+			entry.text,
+			host ? entry.host : string{""}
+		};
+		for (unsigned column = 0; column < 4; column++)
+		{
+			if(shown[i].size() == 4 and shown[i][column] == row[column])
+				continue;
+			list.setText(i, column, row[column]);
+		}
+		shown[i] = row;
+	}
+}
+
+Options::Options(MainWindow * arg_parent)
+{
+	setTitle("Options");
+    parent = arg_parent;
+    setGeometry({64, 256, 340, 500});
+    config_height = 960;
+    config_width = 720;
+    btn_apply.setText("Apply");
+    btn_apply.onActivate = [this]()
+    {
+        std::cout << "UI: Options: Applying options-- \n";
+        m64p_2d_size val = {this->config_height, this->config_width};
+        //std::cout << "UI: Options: Setting resolution to " << std::dec << this->config_height << " " << this->config_width << " (" << std::hex << val << ")\n";
+        auto err = API::CoreDoCommand(M64CMD_CORE_STATE_SET, M64CORE_VIDEO_SIZE, &val);
+        if(err != M64ERR_SUCCESS)
+            std::cout << "UI: Options: Core returned error on attempt to change video size: " << err << "\n";
+        
+    };
+    timinglog.setText("Log frame timing to frametiming.csv");
+    dedupe.setText("Save states into the shared chunk store");
+    rewind.setText("Rewind (hold Backspace)");
+    rewind.onToggle = [this]()
+    {
+        if(!rewinder.enable(rewind.checked()))
+            rewind.setChecked(false);
+    };
+    layout.append(btn_apply, Geometry{10, 10, 40, 24});
+    layout.append(timinglog, Geometry{10, 10+24+4, 320, 24});
+    layout.append(rewind,    Geometry{10, 10+(24+4)*2, 320, 24});
+    layout.append(dedupe,    Geometry{10, 10+(24+4)*3, 320, 24});
+    append(layout);
+    setResizable(false);
+    setVisible(false); // must be after setResizable()
+    onClose = [this]()
+    {
+        this->setVisible(!this->visible());
+    };
+}
+
+Debugger::Debugger(MainWindow * arg_parent)
+{
+	setTitle("Debugger");
+    parent = arg_parent;
+    setGeometry({64, 64, 20+128+4, 10+(24+4)*3+24+10});
+	btn_memory.setText("Memory");
+	btn_memory.onActivate = [this]()
+	{
+		//this->btn_memory.setVisible(!this->btn_memory.visible());
+        this->win_memory.setVisible(true);
+	};
+	btn_registers.setText("Registers");
+	btn_registers.onActivate = [this]()
+	{
+		this->win_registers.setVisible(true);
+		this->win_registers.timer.setEnabled(true);
+	};
+	btn_search.setText("Search");
+	btn_search.onActivate = [this]()
+	{
+		this->win_search.setVisible(true);
+	};
+	btn_commands.setText("Commands");
+	btn_commands.onActivate = [this]()
+	{
+		this->win_commands.setVisible(true);
+	};
+	btn_trace.setText("Trace");
+	btn_trace.onActivate = [this]()
+	{
+		this->win_trace.setVisible(true);
+	};
+	btn_profiler.setText("Profiler");
+	btn_profiler.onActivate = [this]()
+	{
+		this->win_profiler.setVisible(true);
+	};
+	btn_disassembly.setText("Disassembly");
+	btn_disassembly.onActivate = [this]()
+	{
+		this->win_disassembly.setVisible(true);
+		this->win_disassembly.timer.setEnabled(true);
+	};
+	btn_breakpoints.setText("Breakpoints");
+	btn_breakpoints.onActivate = [this]()
+	{
+		this->win_breakpoints.setVisible(true);
+		this->win_breakpoints.timer.setEnabled(true);
+	};
+	
+    layout.append(btn_memory,    Geometry{10     , 10     , 64-2, 24});
+    layout.append(btn_registers, Geometry{10+64+2, 10     , 64-2, 24});
+    layout.append(btn_search,    Geometry{10     , 10+24+4, 64-2, 24});
+    layout.append(btn_commands,  Geometry{10+64+2, 10+24+4, 64-2, 24});
+    layout.append(btn_breakpoints, Geometry{10   , 10+(24+4)*2, 64-2, 24});
+    layout.append(btn_trace,     Geometry{10+64+2, 10+(24+4)*2, 64-2, 24});
+    layout.append(btn_profiler,  Geometry{10     , 10+(24+4)*3, 64-2, 24});
+    layout.append(btn_disassembly, Geometry{10+64+2, 10+(24+4)*3, 64-2, 24});
+	
+    onClose = [this]()
+	{
+		this->parent->win_debugger = NULL;
+	};
+    
+    append(layout);
+    setResizable(false);
+    setVisible(false); // must be after setResizable()
+};
+
+int bootscript( void * ptr )
+{
+    if(!ptr)
     {
-        std::cout << "Audio plugin errored while attaching: " << err;
-        corethread = NULL;
+        std::cout << "UI: Bad window in core boot.\n";
         return 0;
     }
+    MainWindow * mainwin = (MainWindow *)ptr;
     
-    m64p_plugin_type InputType;
-    int InputVersion;
-    const char * InputName;
-    API::InputVersion(&InputType, &InputVersion, NULL, &InputName, NULL);
-    err = API::CoreAttachPlugin(InputType, API::Input);
-    if(err != M64ERR_SUCCESS)
+    std::cout << "UI: Waiting for rom...\n";
+    if(!controller.waitrom() or romname.equals(""))
+    {
+        std::cout << "UI: Bad ROM name, leaving boot script.";
+        controller.set(CoreController::State::Idle);
+        corethread = NULL;
+        return 0;
+    }
+    if(!plugins.start())
+    {
+        std::cout << "UI: Plugins failed to start, leaving boot script.\n";
+        controller.set(CoreController::State::Idle);
+        corethread = NULL;
+        return 0;
+    }
+    m64p_error err = API::CoreDoCommand(M64CMD_ROM_OPEN, API::romsize, API::romdata);
+    if(err)
     {
-        std::cout << "Input plugin errored while attaching: " << err;
+        std::cout << "Error loading ROM: " << err;
+        controller.set(CoreController::State::Idle);
         corethread = NULL;
         return 0;
     }
+    std::cout << "UI: Did load ROM; attaching plugins.\n";
     
-    m64p_plugin_type RSPType;
-    int RSPVersion;
-    const char * RSPName;
-    API::RSPVersion(&RSPType, &RSPVersion, NULL, &RSPName, NULL);
-    err = API::CoreAttachPlugin(RSPType, API::RSP);
+    err = plugins.attach();
     if(err != M64ERR_SUCCESS)
     {
-        std::cout << "RSP plugin errored while attaching: " << err;
+        API::CoreDoCommand(M64CMD_ROM_CLOSE, 0, NULL);
+        controller.set(CoreController::State::Idle);
         corethread = NULL;
         return 0;
     }
     std::cout << "UI: Did attach all plugins; running ROM.\n";
+    controller.set(CoreController::State::Attached);
     // no more returns until tail of function
     
-    mainwin->btn_pauser.setImage(mainwin->img_pause, Orientation::Vertical);
-    mainwin->btn_pauser.onActivate = mainwin->do_pause;
-    mainwin->btn_load.onActivate = mainwin->do_stop;
-    mainwin->btn_load.setText("Stop Emulation");
-    mainwin->paused = false;
+    uiqueue.post(UIQueue::Key::RunButtons, [mainwin]()
+    {
+        mainwin->btn_pauser.setImage(mainwin->img_pause, Orientation::Vertical);
+        mainwin->btn_pauser.onActivate = mainwin->do_pause;
+        mainwin->btn_load.onActivate = mainwin->do_stop;
+        mainwin->btn_load.setText("Stop Emulation");
+        mainwin->paused = false;
+    });
+	
+    API::CoreDoCommand(M64CMD_EXECUTE, 0, NULL);
+    std::cout << "UI: Emulation ended.\n";
+    controller.set(CoreController::State::Stopping);
+    abandonstates();
+    capture.stop();
+    API::CoreDoCommand(M64CMD_ROM_CLOSE, 0, NULL);
+    std::cout << "UI: Did close ROM.\n";
+    
+    auto err2 = plugins.detach();
+    //m64p_error CoreDoCommand(m64p_command Command, int ParamInt, void *ParamPtr)
+    
+    if(err2 == M64ERR_SUCCESS)
+        std::cout << "UI: Did detach all plugins; cleaning state, closing thread.\n";
+    
+    uiqueue.post(UIQueue::Key::RunButtons, [mainwin]()
+    {
+        mainwin->btn_pauser.onActivate = mainwin->do_play;
+        mainwin->btn_load.onActivate = mainwin->do_loadrom;
+        mainwin->btn_load.setText("Load ROM");
+    });
+    controller.set(CoreController::State::Idle);
+    corethread = NULL;
+    
+    std::cout << "UI: Core quit.\n";
+    
+    return 0;
+}
+
+int subbootscript( void * ptr )
+{
+	std::cout << "UI: Started core threads -- waiting on full load.\n";
+	typedef CoreController::State State;
+	controller.waitfor(0, State::Attached, State::Running, State::Paused, State::Idle);
+	if(controller.get() == State::Idle)
+		return 0;
+	
+	if(!controller.waitfor(2000, State::Running, State::Paused, State::Idle))
+		std::cout << "UI: Core locked up for two seconds, you're on your own.\n";
+	if(controller.get() == State::Idle)
+		return 0;
+	
+	if(API::DebugSetRunState(2) == M64ERR_SUCCESS)
+	{
+		std::cout << "UI: Core seemed to allow setting debug run state.\n";
+		if(API::DebugStep() != M64ERR_SUCCESS)
+			std::cout << "UI: Failed to finish resuming emulation.\n";
+		else
+		{
+			std::cout << "UI: Finished loading ROM and initializing emulator.\n";
+			MainWindow * mainwin = (MainWindow *)ptr;
+			uiqueue.post(UIQueue::Key::Debugger, [mainwin]()
+			{
+				if(!mainwin->win_debugger)
+					return;
+				mainwin->win_debugger->win_registers.attach();
+				mainwin->win_debugger->setVisible(true);
+				mainwin->win_debugger->visible = true;
+			});
+		}
+	}
+	else
+		std::cout << "UI: Core does not seem to be built with debugging enabled.\n";
+	
+	return 0;
+}
+
+// Table-driven DEFLATE decoder for compressed ROMs. nall's puff walks codes a bit at a time; here the
+// first ten bits of a code index a lookup table and only rare longer codes take the canonical slow path.
+namespace Inflate
+{
+	struct Huffman
+	{
+		static const unsigned fastbits = 10;
+		uint16_t fast[1 << fastbits]; // symbol << 4 | length; 0 when the code is longer than fastbits
+		short count[16];
+		short symbol[288];
+		
+		bool build(const uint8_t * lengths, unsigned n)
+		{
+			memset(count, 0, sizeof(count));
+			memset(fast, 0, sizeof(fast));
+			for (unsigned i = 0; i < n; i++)
+				count[lengths[i]]++;
+			count[0] = 0;
+			
+			short offsets[16];
+			offsets[1] = 0;
+			for (unsigned len = 1; len < 15; len++)
+				offsets[len+1] = offsets[len]+count[len];
+			for (unsigned i = 0; i < n; i++)
+			{
+				if(lengths[i])
+					symbol[offsets[lengths[i]]++] = i;
+			}
+			
+			// canonical codes, bit-reversed because DEFLATE packs them starting from the low bit
+			unsigned code = 0;
+			unsigned index = 0;
+			int left = 1;
+			for (unsigned len = 1; len < 16; len++)
+			{
+				left = left*2-count[len];
+				if(left < 0)
+					return false;
+				for (int i = 0; i < count[len]; i++, code++, index++)
+				{
+					if(len > fastbits)
+						continue;
+					unsigned reversed = 0;
+					for (unsigned bit = 0; bit < len; bit++)
+						reversed |= ((code >> bit) & 1) << (len-1-bit);
+					for (unsigned fill = reversed; fill < (1u << fastbits); fill += 1 << len)
+						fast[fill] = symbol[index] << 4 | len;
+				}
+				code <<= 1;
+			}
+			return true;
+		}
+	};
+	
+	struct State
+	{
+		const uint8_t * in;
+		const uint8_t * inend;
+		uint64_t buffer;
+		unsigned available;
+		bool overrun;
+		uint8_t * out;
+		uint8_t * outbegin;
+		uint8_t * outend;
+		
+		void need(unsigned bits)
+		{
+			while(available < bits and in < inend)
+			{
+				buffer |= (uint64_t)*in++ << available;
+				available += 8;
+			}
+		}
+		void consume(unsigned bits)
+		{
+			if(bits > available)
+			{
+				overrun = true;
+				bits = available;
+			}
+			buffer >>= bits;
+			available -= bits;
+		}
+		unsigned take(unsigned bits)
+		{
+			if(!bits)
+				return 0;
+			need(bits);
+			unsigned value = buffer & ((1ull << bits)-1);
+			consume(bits);
+			return value;
+		}
+	};
+	
+	int decode(State & s, const Huffman & h)
+	{
+		s.need(15);
+		uint16_t entry = h.fast[s.buffer & ((1 << Huffman::fastbits)-1)];
+		if(entry)
+		{
+			s.consume(entry & 15);
+			return entry >> 4;
+		}
+		int code = 0, first = 0, index = 0;
+		for (unsigned len = 1; len < 16; len++)
+		{
+			code |= s.take(1);
+			int count = h.count[len];
+			if(code-count < first)
+				return h.symbol[index+(code-first)];
+			index += count;
+			first = (first+count) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+	
+	const uint16_t lengthbase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	const uint8_t lengthextra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	const uint16_t distbase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	const uint8_t distextra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	
+	bool codes(State & s, const Huffman & lencode, const Huffman & distcode)
+	{
+		while(true)
+		{
+			int symbol = decode(s, lencode);
+			if(symbol < 0 or s.overrun)
+				return false;
+			if(symbol < 256)
+			{
+				if(s.out == s.outend)
+					return false;
+				*s.out++ = symbol;
+				continue;
+			}
+			if(symbol == 256)
+				return true;
+			symbol -= 257;
+			if(symbol >= 29)
+				return false;
+			unsigned length = lengthbase[symbol]+s.take(lengthextra[symbol]);
+			int distsymbol = decode(s, distcode);
+			if(distsymbol < 0 or distsymbol >= 30)
+				return false;
+			unsigned distance = distbase[distsymbol]+s.take(distextra[distsymbol]);
+			if(s.overrun or distance > (unsigned)(s.out-s.outbegin) or length > (unsigned)(s.outend-s.out))
+				return false;
+			const uint8_t * from = s.out-distance;
+			if(distance >= length)
+				memcpy(s.out, from, length);
+			else
+				for (unsigned i = 0; i < length; i++)
+					s.out[i] = from[i];
+			s.out += length;
+		}
+	}
+	
+	bool stored(State & s)
+	{
+		s.consume(s.available & 7);
+		unsigned length = s.take(16);
+		unsigned complement = s.take(16);
+		if(s.overrun or length != (~complement & 0xFFFF) or length > (unsigned)(s.outend-s.out))
+			return false;
+		while(length and s.available >= 8)
+		{
+			*s.out++ = s.take(8);
+			length--;
+		}
+		if(length > (unsigned)(s.inend-s.in))
+			return false;
+		memcpy(s.out, s.in, length);
+		s.out += length;
+		s.in += length;
+		return true;
+	}
+	
+	// built once by the constructor of a function-local static, which C++11 makes safe for the worker
+	// threads that inflate concurrently
+	struct Fixed
+	{
+		Huffman lencode, distcode;
+		Fixed()
+		{
+			uint8_t lengths[288];
+			unsigned i = 0;
+			for (; i < 144; i++) lengths[i] = 8;
+			for (; i < 256; i++) lengths[i] = 9;
+			for (; i < 280; i++) lengths[i] = 7;
+			for (; i < 288; i++) lengths[i] = 8;
+			lencode.build(lengths, 288);
+			for (i = 0; i < 30; i++) lengths[i] = 5;
+			distcode.build(lengths, 30);
+		}
+	};
+	
+	bool fixed(State & s)
+	{
+		static const Fixed tables;
+		return codes(s, tables.lencode, tables.distcode);
+	}
+	
+	bool dynamic(State & s)
+	{
+		static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+		unsigned nlen = s.take(5)+257;
+		unsigned ndist = s.take(5)+1;
+		unsigned ncode = s.take(4)+4;
+		if(nlen > 286 or ndist > 30)
+			return false;
+		
+		uint8_t lengths[320];
+		memset(lengths, 0, sizeof(lengths));
+		for (unsigned i = 0; i < ncode; i++)
+			lengths[order[i]] = s.take(3);
+		Huffman lencode, distcode;
+		if(!lencode.build(lengths, 19))
+			return false;
+		
+		unsigned index = 0;
+		while(index < nlen+ndist)
+		{
+			int symbol = decode(s, lencode);
+			if(symbol < 0 or s.overrun)
+				return false;
+			if(symbol < 16)
+			{
+				lengths[index++] = symbol;
+				continue;
+			}
+			uint8_t repeat = 0;
+			unsigned times;
+			if(symbol == 16)
+			{
+				if(index == 0)
+					return false;
+				repeat = lengths[index-1];
+				times = 3+s.take(2);
+			}
+			else if(symbol == 17)
+				times = 3+s.take(3);
+			else
+				times = 11+s.take(7);
+			if(index+times > nlen+ndist)
+				return false;
+			while(times--)
+				lengths[index++] = repeat;
+		}
+		if(lengths[256] == 0)
+			return false;
+		if(!lencode.build(lengths, nlen) or !distcode.build(lengths+nlen, ndist))
+			return false;
+		return codes(s, lencode, distcode);
+	}
+	
+	// Decompresses a raw DEFLATE stream into target; returns the number of bytes written, or -1
+	int64_t inflate(uint8_t * target, unsigned targetsize, const uint8_t * source, unsigned sourcesize)
+	{
+		State s;
+		s.in = source;
+		s.inend = source+sourcesize;
+		s.buffer = 0;
+		s.available = 0;
+		s.overrun = false;
+		s.out = s.outbegin = target;
+		s.outend = target+targetsize;
+		
+		bool last;
+		do
+		{
+			last = s.take(1);
+			unsigned type = s.take(2);
+			bool ok = type == 0 ? stored(s) : type == 1 ? fixed(s) : type == 2 ? dynamic(s) : false;
+			if(!ok or s.overrun)
+				return -1;
+		} while(!last);
+		return s.out-s.outbegin;
+	}
+}
+
+// Deflate encoder for savestates: greedy LZ77 over a one-entry-per-hash table, emitted as a single
+// fixed-Huffman block. Far cheaper than a zlib-style chained search, and any inflate can read it.
+namespace Deflate
+{
+	unsigned reverse(unsigned code, unsigned bits)
+	{
+		unsigned result = 0;
+		for (unsigned i = 0; i < bits; i++)
+			result |= ((code >> i) & 1) << (bits-1-i);
+		return result;
+	}
+	
+	struct Tables
+	{
+		uint16_t literal[288]; // fixed codes, bit-reversed for LSB-first output
+		uint8_t literalbits[288];
+		uint8_t distance[30];
+		uint8_t lengthcode[259];
+		uint8_t distancecode[512]; // zlib's trick: distances up to 256 directly, longer ones by (d-1) >> 7
+		
+		Tables()
+		{
+			for (unsigned i = 0; i < 288; i++)
+			{
+				unsigned code, bits;
+				if(i < 144)
+					code = 0x30+i, bits = 8;
+				else if(i < 256)
+					code = 0x190+i-144, bits = 9;
+				else if(i < 280)
+					code = i-256, bits = 7;
+				else
+					code = 0xC0+i-280, bits = 8;
+				literal[i] = reverse(code, bits);
+				literalbits[i] = bits;
+			}
+			for (unsigned code = 0; code < 30; code++)
+				distance[code] = reverse(code, 5);
+			for (unsigned code = 0; code < 29; code++)
+			{
+				for (unsigned length = Inflate::lengthbase[code]; length < Inflate::lengthbase[code]+(1u << Inflate::lengthextra[code]) and length <= 258; length++)
+					lengthcode[length] = code;
+			}
+			for (unsigned code = 0; code < 30; code++)
+			{
+				for (unsigned d = Inflate::distbase[code]; d < Inflate::distbase[code]+(1u << Inflate::distextra[code]); d++)
+					distancecode[d <= 256 ? d-1 : 256+((d-1) >> 7)] = code;
+			}
+		}
+	};
+	
+	struct Writer
+	{
+		uint8_t * out;
+		uint64_t bits;
+		unsigned count;
+		
+		void put(unsigned value, unsigned length)
+		{
+			bits |= (uint64_t)value << count;
+			count += length;
+			while(count >= 8)
+			{
+				*out++ = bits;
+				bits >>= 8;
+				count -= 8;
+			}
+		}
+	};
+	
+	// worst case is every byte a 9-bit literal
+	unsigned bound(unsigned length)
+	{
+		return length+length/8+16;
+	}
+	
+	unsigned deflate(uint8_t * target, const uint8_t * source, unsigned length)
+	{
+		static const Tables tables;
+		static const unsigned hashbits = 15;
+		std::vector<int32_t> recent(1 << hashbits, -1);
+		Writer writer = {target, 0, 0};
+		writer.put(1, 1); // final block
+		writer.put(1, 2); // fixed codes
+		
+		unsigned i = 0;
+		while(i+4 <= length)
+		{
+			uint32_t word;
+			memcpy(&word, source+i, 4);
+			unsigned hash = (word*2654435761u) >> (32-hashbits);
+			int32_t candidate = recent[hash];
+			recent[hash] = i;
+			if(candidate < 0 or i-candidate > 32768 or memcmp(source+candidate, source+i, 4))
+			{
+				writer.put(tables.literal[source[i]], tables.literalbits[source[i]]);
+				i++;
+				continue;
+			}
+			unsigned limit = min(258u, length-i);
+			unsigned match = 4;
+			while(match < limit and source[candidate+match] == source[i+match])
+				match++;
+			unsigned distance = i-candidate;
+			unsigned code = tables.lengthcode[match];
+			writer.put(tables.literal[257+code], tables.literalbits[257+code]);
+			writer.put(match-Inflate::lengthbase[code], Inflate::lengthextra[code]);
+			code = tables.distancecode[distance <= 256 ? distance-1 : 256+((distance-1) >> 7)];
+			writer.put(tables.distance[code], 5);
+			writer.put(distance-Inflate::distbase[code], Inflate::distextra[code]);
+			i += match;
+		}
+		for (; i < length; i++)
+			writer.put(tables.literal[source[i]], tables.literalbits[source[i]]);
+		writer.put(tables.literal[256], tables.literalbits[256]);
+		if(writer.count)
+			*writer.out++ = writer.bits;
+		return writer.out-target;
+	}
+}
+
+// Content-addressed savestate store. States are cut wherever a gear rolling hash of the last 64 bytes
+// hits a boundary pattern, so a change only disturbs the chunks around it. Each distinct chunk is kept
+// once in states.pack and found by its SHA-256 through states.idx; a slot file just lists digests.
+// Both are read through filemaps, and loading writes chunks straight out of the pack mapping. The pack
+// only grows: chunks no slot refers to any more stay in it.
+struct ChunkStore
+{
+	static const unsigned recordsize = 32+8+4; // digest, pack offset, length
+	static const unsigned minimum = 2048;
+	static const unsigned maximum = 65536;
+	static const uint64_t boundary = 0xFFF8000000000000ull; // 13 bits, ~8KB average past the minimum
+	
+	uint64_t gear[256];
+	filemap pack;
+	filemap index;
+	unsigned mapped; // records in the index mapping
+	std::vector<uint8_t> added; // records of the save in progress, not yet in the mapping
+	std::unordered_map<uint64_t, unsigned> lookup; // first eight digest bytes -> record number
+	bool opened;
+	
+	ChunkStore() : mapped(0), opened(false) {}
+	
+	// Maps both files again. lookup already holds the records of the last save under the numbers they
+	// got in the index, so it is only rebuilt when the index isn't what it expects (first open, or a
+	// save that failed to append).
+	void remap()
+	{
+		unsigned expected = mapped+added.size()/recordsize;
+		pack.close();
+		index.close();
+		added.clear();
+		mapped = 0;
+		if(file::size("states.pack") and !pack.open("states.pack", filemap::mode::read))
+		{
+			lookup.clear();
+			return;
+		}
+		if(file::size("states.idx") and index.open("states.idx", filemap::mode::read))
+			mapped = index.size()/recordsize;
+		if(mapped == expected)
+			return;
+		lookup.clear();
+		for (unsigned i = 0; i < mapped; i++)
+		{
+			uint64_t key;
+			memcpy(&key, index.data()+i*recordsize, 8);
+			lookup[key] = i;
+		}
+	}
+	
+	void open()
+	{
+		if(opened)
+			return;
+		uint64_t seed = 0x9E3779B97F4A7C15ull;
+		for (auto & entry : gear)
+		{
+			// splitmix64, so the table (and therefore every boundary) is the same on every run
+			uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+			entry = z ^ (z >> 31);
+		}
+		remap();
+		opened = true;
+	}
+	
+	const uint8_t * record(unsigned number)
+	{
+		return number < mapped ? index.data()+number*recordsize : added.data()+(number-mapped)*recordsize;
+	}
+	
+	// pack offset and length of the chunk with this digest, or false if it isn't stored yet
+	bool find(const uint8_t * digest, uint64_t & offset, uint32_t & length)
+	{
+		uint64_t key;
+		memcpy(&key, digest, 8);
+		auto found = lookup.find(key);
+		if(found == lookup.end() or memcmp(record(found->second), digest, 32))
+			return false;
+		memcpy(&offset, record(found->second)+32, 8);
+		memcpy(&length, record(found->second)+40, 4);
+		return true;
+	}
+	
+	unsigned cut(const uint8_t * data, unsigned size)
+	{
+		if(size <= minimum)
+			return size;
+		unsigned limit = min(size, maximum);
+		uint64_t hash = 0;
+		for (unsigned i = minimum; i < limit; i++)
+		{
+			hash = (hash << 1)+gear[data[i]];
+			if(!(hash & boundary))
+				return i+1;
+		}
+		return limit;
+	}
+	
+	// Stores data's chunks and writes the list of their digests to recipe.
+	bool put(const uint8_t * data, unsigned size, const string & recipe, unsigned & chunks, unsigned & written)
+	{
+		open();
+		file output;
+		if(!output.open(recipe, file::mode::write))
+			return false;
+		uint64_t packsize = file::size("states.pack");
+		output.print("panui-chunks\n");
+		output.writel(size, 8);
+		output.writel(0, 4); // chunk count, patched below
+		
+		std::vector<uint8_t> fresh; // chunks the pack doesn't have yet
+		chunks = 0;
+		for (unsigned offset = 0; offset < size;)
+		{
+			unsigned length = cut(data+offset, size-offset);
+			sha256_ctx context;
+			uint8_t digest[32];
+			sha256_init(&context);
+			sha256_chunk(&context, data+offset, length);
+			sha256_final(&context);
+			sha256_hash(&context, digest);
+			
+			uint64_t stored;
+			uint32_t storedlength;
+			if(!find(digest, stored, storedlength))
+			{
+				uint8_t entry[recordsize];
+				uint64_t at = packsize+fresh.size();
+				uint32_t length32 = length;
+				memcpy(entry, digest, 32);
+				memcpy(entry+32, &at, 8);
+				memcpy(entry+40, &length32, 4);
+				added.insert(added.end(), entry, entry+recordsize);
+				uint64_t key;
+				memcpy(&key, digest, 8);
+				lookup[key] = mapped+added.size()/recordsize-1;
+				fresh.insert(fresh.end(), data+offset, data+offset+length);
+			}
+			output.write(digest, 32);
+			chunks++;
+			offset += length;
+		}
+		output.seek(13+8);
+		output.writel(chunks, 4);
+		output.close();
+		written = fresh.size();
+		
+		// the mappings have to go before the files can be extended; pack data goes out before the
+		// index entries that point at it, so a torn write leaves only unreferenced bytes behind
+		pack.close();
+		index.close();
+		file packout, indexout;
+		bool ok = openappend(packout, "states.pack");
+		if(ok)
+		{
+			packout.write(fresh.data(), fresh.size());
+			packout.close();
+			ok = openappend(indexout, "states.idx");
+		}
+		if(ok)
+		{
+			indexout.write(added.data(), added.size());
+			indexout.close();
+		}
+		remap();
+		return ok;
+	}
+	
+	// Reassembles the state listed in recipe into target.
+	bool get(const string & recipe, const string & target)
+	{
+		open();
+		auto list = file::read(recipe);
+		if(list.size() < 13+8+4 or memcmp(list.data(), "panui-chunks\n", 13))
+			return false;
+		uint64_t size = 0;
+		unsigned count = 0;
+		for (unsigned i = 0; i < 8; i++)
+			size |= (uint64_t)list[13+i] << (i*8);
+		for (unsigned i = 0; i < 4; i++)
+			count |= list[13+8+i] << (i*8);
+		if(list.size() < 13+8+4+count*32ull)
+			return false;
+		
+		file output;
+		if(!output.open(target, file::mode::write))
+			return false;
+		uint64_t total = 0;
+		for (unsigned i = 0; i < count; i++)
+		{
+			uint64_t offset;
+			uint32_t length;
+			if(!find(list.data()+13+8+4+i*32, offset, length) or offset+length > pack.size())
+				return false;
+			output.write(pack.data()+offset, length);
+			total += length;
+		}
+		return total == size;
+	}
+} chunkstore;
+
+// Savestates behind the Save and Load buttons. Saving asks the core for an uncompressed snapshot, which
+// is all the game thread waits on; a writer thread deflates it into a gzip file under a temporary name
+// and renames that over the old file. Loading inflates on the same thread and hands the core the result.
+struct SaveStates
+{
+	enum class Job : unsigned { None, Save, Load };
+	static const unsigned thumbwidth = 160;
+	static const unsigned thumbheight = 120;
+	unsigned slot;
+	std::atomic<bool> dedupe; // save into the chunk store rather than as gzip
+	string target; // file of the current job, fixed when it was requested
+	std::atomic<Job> job;
+	std::atomic<bool> snapshot; // what the core's SAVECOMPLETE said
+	SDL_sem * wake;
+	SDL_sem * loaded;
+	SDL_Thread * writer;
+	nall::function<void()> onsaved; // GUI thread, after a save has been written
+	
+	// the screen at save time, shrunk on the core thread
+	std::atomic<bool> wantthumb;
+	std::atomic<bool> thumbready;
+	std::vector<uint8_t> screen;
+	uint8_t thumb[thumbwidth*thumbheight*3];
+	
+	SaveStates() : slot(0), dedupe(false), job(Job::None), snapshot(false), wake(NULL), loaded(NULL), writer(NULL), wantthumb(false), thumbready(false) {}
+	
+	static bool emulating()
+	{
+		auto state = controller.get();
+		return state == CoreController::State::Running or state == CoreController::State::Paused;
+	}
+	
+	string filename(unsigned which, bool chunked)
+	{
+		string name = romname != "" ? basename(notdir(romname)) : string("panui");
+		return {name, ".st", which, chunked ? ".chunks" : ".gz"};
+	}
+	// whichever kind of file the slot has
+	string existing(unsigned which)
+	{
+		string chunked = filename(which, true);
+		return file::exists(chunked) ? chunked : filename(which, false);
+	}
+	string thumbnail(unsigned which)
+	{
+		string name = romname != "" ? basename(notdir(romname)) : string("panui");
+		return {name, ".st", which, ".png"};
+	}
+	
+	// panui's slots are its own files next to the ROM; the core's slot hotkeys keep writing the core's
+	// separate .stN files in its save directory, which these never read
+	void select(unsigned which)
+	{
+		slot = which;
+	}
+	
+	void initialize()
+	{
+		wake = SDL_CreateSemaphore(0);
+		loaded = SDL_CreateSemaphore(0);
+		writer = SDL_CreateThread(writerscript, "SaveStates", this);
+	}
+	
+	// GUI thread
+	bool save()
+	{
+		if(job != Job::None or !emulating())
+			return false;
+		if(!claimstate(StateJob::Slot))
+			return false;
+		target = filename(slot, dedupe);
+		job = Job::Save;
+		thumbready = false;
+		wantthumb = true;
+		if(API::CoreDoCommand(M64CMD_STATE_SAVE, 3, (void *)"savestate.tmp") != M64ERR_SUCCESS)
+		{
+			wantthumb = false;
+			statejob = StateJob::None;
+			job = Job::None;
+			return false;
+		}
+		return true;
+	}
+	bool load()
+	{
+		if(job != Job::None or !emulating())
+			return false;
+		target = existing(slot);
+		if(!file::exists(target))
+		{
+			std::cout << "UI: No savestate " << (const char *)target << ".\n";
+			return false;
+		}
+		job = Job::Load;
+		SDL_SemPost(wake);
+		return true;
+	}
+	
+	// core thread
+	void frame()
+	{
+		if(!wantthumb)
+			return;
+		wantthumb = false;
+		int size = 0;
+		API::CoreDoCommand(M64CMD_CORE_STATE_QUERY, M64CORE_VIDEO_SIZE, &size);
+		unsigned width = size >> 16 & 0xFFFF, height = size & 0xFFFF;
+		if(!width or !height)
+			return;
+		if(screen.size() < width*height*3)
+			screen.resize(width*height*3);
+		if(API::CoreDoCommand(M64CMD_READ_SCREEN, 0, screen.data()) != M64ERR_SUCCESS)
+			return;
+		// nearest neighbour; the screen comes bottom row first
+		for (unsigned y = 0; y < thumbheight; y++)
+		{
+			const uint8_t * row = screen.data()+(height-1-y*height/thumbheight)*width*3;
+			for (unsigned x = 0; x < thumbwidth; x++)
+				memcpy(thumb+(y*thumbwidth+x)*3, row+x*width/thumbwidth*3, 3);
+		}
+		thumbready = true;
+	}
+	void complete(m64p_core_param param, int value)
+	{
+		if(param == M64CORE_STATE_SAVECOMPLETE and job == Job::Save)
+		{
+			snapshot = value != 0;
+			SDL_SemPost(wake);
+		}
+		else if(param == M64CORE_STATE_LOADCOMPLETE)
+			SDL_SemPost(loaded);
+	}
+	
+	void write()
+	{
+		Uint32 begin = SDL_GetTicks();
+		auto state = file::read("savestate.tmp");
+		if(!snapshot or state.size() == 0)
+		{
+			std::cout << "UI: Core could not snapshot state.\n";
+			return;
+		}
+		string temporary = {target, ".tmp"};
+		unsigned chunks = 0, length = 0;
+		if(target.endsWith(".chunks"))
+		{
+			if(!chunkstore.put(state.data(), state.size(), temporary, chunks, length))
+			{
+				std::cout << "UI: Could not write to the savestate chunk store.\n";
+				return;
+			}
+		}
+		else
+		{
+			std::vector<uint8_t> packed(Deflate::bound(state.size()));
+			length = Deflate::deflate(packed.data(), state.data(), state.size());
+			file output;
+			if(!output.open(temporary, file::mode::write))
+				return;
+			const uint8_t header[10] = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF};
+			output.write(header, sizeof(header));
+			output.write(packed.data(), length);
+			output.writel(crc32_calculate(state.data(), state.size()), 4);
+			output.writel(state.size(), 4);
+			output.close();
+			length += 18;
+		}
+		file::remove(target);
+		if(!file::move(temporary, target))
+		{
+			std::cout << "UI: Could not replace " << (const char *)target << ".\n";
+			return;
+		}
+		// a slot holds one kind of file at a time; slot may have moved on since the save was requested
+		file::remove({basename(target), target.endsWith(".chunks") ? ".gz" : ".chunks"});
+		if(chunks)
+			std::cout << "UI: Saved state to " << (const char *)target << " (" << chunks << " chunks, " << length/1024 << "KB of them new) in " << SDL_GetTicks()-begin << "ms.\n";
+		else
+			std::cout << "UI: Saved state to " << (const char *)target << " (" << state.size()/1024 << "KB -> " << length/1024 << "KB) in " << SDL_GetTicks()-begin << "ms.\n";
+		
+		string picture = {basename(target), ".png"};
+		if(thumbready)
+			writethumbnail(picture);
+		else
+			file::remove(picture);
+		SaveStates * self = this;
+		uiqueue.post(UIQueue::Key::Savestates, [self]()
+		{
+			if(self->onsaved)
+				self->onsaved();
+		});
+	}
+	
+	// 24-bit PNG with unfiltered rows; the zlib stream is the same fixed-Huffman deflate
+	void writethumbnail(const string & name)
+	{
+		const unsigned stride = thumbwidth*3+1;
+		uint8_t raw[stride*thumbheight];
+		for (unsigned y = 0; y < thumbheight; y++)
+		{
+			raw[y*stride] = 0;
+			memcpy(raw+y*stride+1, thumb+y*thumbwidth*3, thumbwidth*3);
+		}
+		std::vector<uint8_t> idat(2+Deflate::bound(sizeof(raw))+4);
+		idat[0] = 0x78;
+		idat[1] = 0x01;
+		unsigned length = 2+Deflate::deflate(idat.data()+2, raw, sizeof(raw));
+		uint32_t a = 1, b = 0;
+		for (unsigned i = 0; i < sizeof(raw); i++)
+		{
+			a = (a+raw[i]) % 65521;
+			b = (b+a) % 65521;
+		}
+		for (unsigned i = 0; i < 4; i++)
+			idat[length++] = (b << 16 | a) >> (24-i*8);
+		
+		uint8_t header[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 2, 0, 0, 0};
+		for (unsigned i = 0; i < 4; i++)
+		{
+			header[i] = thumbwidth >> (24-i*8);
+			header[4+i] = thumbheight >> (24-i*8);
+		}
+		file output;
+		if(!output.open(name, file::mode::write))
+			return;
+		const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		output.write(signature, sizeof(signature));
+		auto chunk = [&output](const char * type, const uint8_t * data, unsigned size)
+		{
+			uint32_t crc = ~0;
+			for (unsigned i = 0; i < 4; i++)
+				crc = crc32_adjust(crc, type[i]);
+			for (unsigned i = 0; i < size; i++)
+				crc = crc32_adjust(crc, data[i]);
+			output.writem(size, 4);
+			output.write((const uint8_t *)type, 4);
+			output.write(data, size);
+			output.writem(~crc, 4);
+		};
+		chunk("IHDR", header, sizeof(header));
+		chunk("IDAT", idat.data(), length);
+		chunk("IEND", NULL, 0);
+	}
+	
+	void read()
+	{
+		if(target.endsWith(".chunks"))
+		{
+			if(!chunkstore.get(target, "savestate-load.tmp"))
+			{
+				std::cout << "UI: Savestate " << (const char *)target << " refers to chunks the store doesn't have.\n";
+				return;
+			}
+			restore();
+			return;
+		}
+		auto packed = file::read(target);
+		if(packed.size() < 18 or packed[0] != 0x1F or packed[1] != 0x8B or packed[2] != 8 or packed[3] != 0)
+		{
+			std::cout << "UI: " << (const char *)target << " is not a panui savestate.\n";
+			return;
+		}
+		unsigned length = packed.size();
+		unsigned original = packed[length-4] | packed[length-3] << 8 | packed[length-2] << 16 | packed[length-1] << 24;
+		std::vector<uint8_t> state(max(original, 1u));
+		if(Inflate::inflate(state.data(), original, packed.data()+10, length-18) != original or !file::write("savestate-load.tmp", state.data(), original))
+		{
+			std::cout << "UI: Savestate " << (const char *)target << " is corrupt.\n";
+			return;
+		}
+		restore();
+	}
+	
+	// the core went away with our job still queued: a save's completion won't come, a load's waiter can stop
+	void abandon()
+	{
+		if(job == Job::Save)
+		{
+			wantthumb = false;
+			job = Job::None;
+		}
+		else
+			SDL_SemPost(loaded);
+	}
+	
+	// hands savestate-load.tmp to the core and waits for it to be loaded
+	void restore()
+	{
+		for (unsigned tries = 0; !claimstate(StateJob::Slot); tries++)
+		{
+			if(tries == 100)
+				return;
+			SDL_Delay(10);
+		}
+		while(SDL_SemTryWait(loaded) == 0);
+		if(API::CoreDoCommand(M64CMD_STATE_LOAD, 0, (void *)"savestate-load.tmp") == M64ERR_SUCCESS)
+			SDL_SemWaitTimeout(loaded, 2000);
+		else
+			statejob = StateJob::None;
+	}
+	
+	static int writerscript(void * ptr)
+	{
+		SaveStates & self = *(SaveStates *)ptr;
+		while(true)
+		{
+			SDL_SemWait(self.wake);
+			if(self.job == Job::Save)
+				self.write();
+			else if(self.job == Job::Load)
+				self.read();
+			self.job = Job::None;
+		}
+		return 0;
+	}
+} savestates;
+
+// savestate completions from the core's state callback, passed to whoever queued the job
+void statecomplete (m64p_core_param param, int value)
+{
+	StateJob job = statejob.exchange(StateJob::None);
+	if(job == StateJob::Rewind)
+		rewinder.complete(param, value);
+	else if(job == StateJob::Slot)
+		savestates.complete(param, value);
+}
+
+// Emulation ended, so a job still claimed will never complete; without this every later save, load and
+// rewind would be refused until restart. Only called once the core thread is out of EXECUTE.
+void abandonstates ()
+{
+	StateJob job = statejob.exchange(StateJob::None);
+	if(job == StateJob::Rewind)
+		rewinder.abandon();
+	else if(job == StateJob::Slot)
+		savestates.abandon();
+}
+
+void framecallback ( unsigned int )
+{
+	frametiming.frame();
+	controller.frame();
+	livememory.capture();
+	profiler.frame();
+	batch.frame();
+	rewinder.frame();
+	savestates.frame();
+	capture.frame();
+}
+
+// Slot browser. Opening it only stats the slot files; a thumbnail is decoded when its slot is selected,
+// and the last few decoded ones are kept (most recent first) so flipping between slots stays cheap.
+struct SlotWindow : Window
+{
+	FixedLayout layout;
+	ListView list;
+	Canvas preview;
+	Button btn_save;
+	Button btn_load;
+	Label status;
+	
+	static const unsigned slots = 100;
+	static const unsigned cachesize = 8;
+	struct Thumbnail
+	{
+		unsigned slot;
+		time_t stamp;
+		image picture;
+	};
+	std::vector<Thumbnail> cache;
+	
+	void refresh();
+	void show(unsigned slot);
+	SlotWindow();
+};
+
+SlotWindow::SlotWindow()
+{
+	setTitle("Savestates");
+	
+	list.setHeaderText({"Slot", "Saved", "Size"});
+	list.setHeaderVisible();
+	list.onChange = [this]()
+	{
+		if(!list.selected())
+			return;
+		savestates.select(list.selection());
+		show(list.selection());
+	};
+	list.onActivate = [this]()
+	{
+		if(list.selected() and !savestates.load())
+			status.setText("Can't load right now.");
+	};
+	
+	btn_save.setText("Save");
+	btn_save.onActivate = [this]()
+	{
+		status.setText(savestates.save() ? "Saving..." : "Can't save right now.");
+	};
+	btn_load.setText("Load");
+	btn_load.onActivate = [this]()
+	{
+		status.setText(savestates.load() ? "" : "Can't load right now.");
+	};
+	savestates.onsaved = [this]()
+	{
+		status.setText("");
+		if(visible())
+			refresh();
+	};
+	
+	layout.append(list,     Geometry{10            , 10, 240, 300});
+	layout.append(preview,  Geometry{10+240+4      , 10, SaveStates::thumbwidth, SaveStates::thumbheight});
+	layout.append(btn_save, Geometry{10+240+4      , 10+SaveStates::thumbheight+4, 64, 24});
+	layout.append(btn_load, Geometry{10+240+4+64+4 , 10+SaveStates::thumbheight+4, 64, 24});
+	layout.append(status,   Geometry{10+240+4      , 10+SaveStates::thumbheight+4+24+4, SaveStates::thumbwidth, 24});
+	append(layout);
+	
+	setGeometry({192, 192, 10+240+4+SaveStates::thumbwidth+10, 10+300+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+void SlotWindow::refresh()
+{
+	list.reset();
+	for (unsigned slot = 0; slot < slots; slot++)
+	{
+		string name = savestates.existing(slot);
+		if(!file::exists(name))
+		{
+			list.append({string{"Slot ", slot}, "", ""});
+			continue;
+		}
+		char saved[32];
+		time_t stamp = file::timestamp(name, file::time::modify);
+		strftime(saved, sizeof(saved), "%Y-%m-%d %H:%M:%S", localtime(&stamp));
+		list.append({string{"Slot ", slot}, saved, string{(unsigned)(file::size(name)/1024), " KB"}});
+	}
+	list.autoSizeColumns();
+	list.setSelection(savestates.slot);
+	show(savestates.slot);
+}
+
+void SlotWindow::show(unsigned slot)
+{
+	string name = savestates.thumbnail(slot);
+	time_t stamp = file::exists(name) ? file::timestamp(name, file::time::modify) : 0;
+	for (unsigned i = 0; i < cache.size(); i++)
+	{
+		if(cache[i].slot != slot)
+			continue;
+		if(cache[i].stamp != stamp)
+		{
+			cache.erase(cache.begin()+i);
+			break;
+		}
+		std::rotate(cache.begin(), cache.begin()+i, cache.begin()+i+1);
+		preview.setImage(cache[0].picture);
+		return;
+	}
+	
+	Thumbnail thumbnail = {slot, stamp, image()};
+	if(!stamp or !thumbnail.picture.load(name))
+	{
+		preview.setColor({0, 0, 0});
+		return;
+	}
+	if(cache.size() == cachesize)
+		cache.pop_back();
+	cache.insert(cache.begin(), thumbnail);
+	preview.setImage(cache[0].picture);
+}
+
+
+// The ROM being booted. Big-endian (.z64) dumps are passed to the core straight out of a read-only
+// mapping; byte-swapped dumps get one owned copy, swapped on the way in. Zip and gzip archives are
+// inflated directly into the owned buffer, sized from the archive's own uncompressed length, and
+// swapped in place. Checksums run on a worker.
+struct RomImage
+{
+	enum class Order : unsigned { Unknown, Z64, V64, N64 };
+	filemap map;
+	uint8_t * owned;
+	uint8_t * data;
+	unsigned size;
+	Order order;
+	m64p_rom_header header;
+	SDL_Thread * hasher;
+	
+	RomImage() : owned(NULL), data(NULL), size(0), order(Order::Unknown), hasher(NULL) {}
+	
+	static Order detect(const uint8_t * bytes, unsigned length)
+	{
+		if(length < 4)
+			return Order::Unknown;
+		if(bytes[0] == 0x80 and bytes[1] == 0x37 and bytes[2] == 0x12 and bytes[3] == 0x40)
+			return Order::Z64;
+		if(bytes[0] == 0x37 and bytes[1] == 0x80 and bytes[2] == 0x40 and bytes[3] == 0x12)
+			return Order::V64;
+		if(bytes[0] == 0x40 and bytes[1] == 0x12 and bytes[2] == 0x37 and bytes[3] == 0x80)
+			return Order::N64;
+		return Order::Unknown;
+	}
+	
+	// Copies source into target in big-endian order. Written as plain 32-bit lane arithmetic so the
+	// compiler can vectorize it; trailing bytes past the last whole word are copied as they are.
+	static void normalize(uint8_t * target, const uint8_t * source, unsigned length, Order from)
+	{
+		unsigned words = length/4;
+		const uint32_t * in = (const uint32_t *)source;
+		uint32_t * out = (uint32_t *)target;
+		if(from == Order::V64)
+		{
+			for (unsigned i = 0; i < words; i++)
+			{
+				uint32_t x = in[i];
+				out[i] = ((x >> 8) & 0x00FF00FF) | ((x << 8) & 0xFF00FF00);
+			}
+		}
+		else if(from == Order::N64)
+		{
+			for (unsigned i = 0; i < words; i++)
+			{
+				uint32_t x = in[i];
+				out[i] = (x >> 24) | ((x >> 8) & 0x0000FF00) | ((x << 8) & 0x00FF0000) | (x << 24);
+			}
+		}
+		else if(target != source)
+			memcpy(target, source, words*4);
+		if(target != source)
+			memcpy(target+words*4, source+words*4, length-words*4);
+	}
+	
+	static uint32_t big32(const uint32_t & value)
+	{
+		const uint8_t * bytes = (const uint8_t *)&value;
+		return bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+	}
+	
+	static int hashscript(void * ptr)
+	{
+		RomImage & self = *(RomImage *)ptr;
+		uint32_t crc = crc32_calculate(self.data, self.size);
+		sha256_ctx context;
+		uint8_t digest[32];
+		sha256_init(&context);
+		sha256_chunk(&context, self.data, self.size);
+		sha256_final(&context);
+		sha256_hash(&context, digest);
+		string text;
+		for (auto byte : digest)
+			text.append(hex<2>(byte));
+		std::cout << "UI: ROM CRC32 " << (const char *)hex<8>(crc) << ", SHA-256 " << (const char *)text << "\n";
+		return 0;
+	}
+	
+	void close()
+	{
+		if(hasher)
+			SDL_WaitThread(hasher, NULL);
+		hasher = NULL;
+		map.close();
+		free(owned);
+		owned = NULL;
+		data = NULL;
+		size = 0;
+	}
+	
+	// parses the header of the normalized image and starts checksumming it
+	bool finish()
+	{
+		if(size < sizeof(m64p_rom_header))
+			return false;
+		memcpy(&header, data, sizeof(header));
+		header.ClockRate = big32(header.ClockRate);
+		header.PC = big32(header.PC);
+		header.Release = big32(header.Release);
+		header.CRC1 = big32(header.CRC1);
+		header.CRC2 = big32(header.CRC2);
+		
+		char name[sizeof(header.Name)+1];
+		memcpy(name, header.Name, sizeof(header.Name));
+		name[sizeof(header.Name)] = 0;
+		std::cout << "UI: ROM header: \"" << string(name).rtrim() << "\", CRC " << (const char *)hex<8>(header.CRC1) << "-" << (const char *)hex<8>(header.CRC2) << ", entry 0x" << (const char *)hex<8>(header.PC) << "\n";
+		
+		hasher = SDL_CreateThread(hashscript, "RomHash", this);
+		return true;
+	}
+	
+	bool extract(const uint8_t * source, unsigned sourcesize, unsigned length, bool compressed)
+	{
+		owned = (uint8_t *)malloc(max(length, 4u));
+		if(!owned)
+			return false;
+		if(!compressed)
+		{
+			if(length > sourcesize)
+				return false;
+			memcpy(owned, source, length);
+		}
+		else if(Inflate::inflate(owned, length, source, sourcesize) != length)
+		{
+			std::cout << "UI: ROM archive is corrupt.\n";
+			return false;
+		}
+		data = owned;
+		size = length;
+		order = detect(data, size);
+		normalize(data, data, size, order);
+		map.close();
+		return finish();
+	}
+	
+	bool loadzip()
+	{
+		unzip archive;
+		if(!archive.open(map.data(), map.size()) or archive.file.size() == 0)
+			return false;
+		unsigned pick = 0;
+		for (unsigned i = 0; i < archive.file.size(); i++)
+		{
+			string & name = archive.file[i].name;
+			if(name.iendsWith(".z64") or name.iendsWith(".v64") or name.iendsWith(".n64"))
+			{
+				pick = i;
+				break;
+			}
+		}
+		auto & entry = archive.file[pick];
+		if(entry.cmode != 0 and entry.cmode != 8)
+			return false;
+		std::cout << "UI: Extracting " << (const char *)entry.name << " from zip.\n";
+		return extract(entry.data, map.data()+map.size()-entry.data, entry.size, entry.cmode == 8);
+	}
+	
+	bool loadgzip()
+	{
+		const uint8_t * bytes = map.data();
+		unsigned length = map.size();
+		if(length < 18 or bytes[2] != 8)
+			return false;
+		uint8_t flags = bytes[3];
+		unsigned offset = 10;
+		if(flags & 0x04)
+			offset += 2+(bytes[offset] | bytes[offset+1] << 8);
+		if(flags & 0x08)
+			while(offset < length and bytes[offset++]);
+		if(flags & 0x10)
+			while(offset < length and bytes[offset++]);
+		if(flags & 0x02)
+			offset += 2;
+		if(offset+8 > length)
+			return false;
+		unsigned original = bytes[length-4] | bytes[length-3] << 8 | bytes[length-2] << 16 | bytes[length-1] << 24;
+		return extract(bytes+offset, length-8-offset, original, true);
+	}
+	
+	bool load(const string & filename)
+	{
+		close();
+		if(!map.open(filename, filemap::mode::read))
+			return false;
+		if(map.size() >= 4 and map.data()[0] == 'P' and map.data()[1] == 'K' and map.data()[2] == 3 and map.data()[3] == 4)
+			return loadzip();
+		if(map.size() >= 2 and map.data()[0] == 0x1F and map.data()[1] == 0x8B)
+			return loadgzip();
+		order = detect(map.data(), map.size());
+		size = map.size();
+		if(order == Order::Z64 or order == Order::Unknown)
+			data = map.data();
+		else
+		{
+			owned = (uint8_t *)malloc(size);
+			normalize(owned, map.data(), size, order);
+			data = owned;
+			map.close();
+		}
+		return finish();
+	}
+} rom;
+
+// ROM library. Folders are listed by a few threads at once and each ROM is only mapped far enough to
+// read its 64-byte header; CRC32s of whole images are filled in afterwards by a small pool. Results are
+// kept in library.idx keyed by path, mtime and size, so a rescan only reopens files that changed.
+struct Library
+{
+	struct Entry
+	{
+		string path;
+		uint64_t mtime;
+		uint64_t size;
+		string name;
+		Uint32 crc1;
+		Uint32 crc2;
+		Uint32 crc32;
+		char country;
+		bool hashed;
+	};
+	static const unsigned threads = 4;
+	
+	std::vector<Entry> entries; // GUI thread; replaced as a whole when a scan finishes
+	lstring folders;
+	std::atomic<bool> scanning;
+	std::atomic<unsigned> progress;
+	
+	// scan state
+	std::vector<Entry> scanned;
+	std::map<string, const Entry *> previous;
+	std::vector<string> pending; // folders nobody has listed yet
+	unsigned busy; // walkers currently listing a folder
+	SDL_mutex * lock;
+	SDL_cond * wake;
+	std::atomic<unsigned> next;
+	nall::function<void()> finished;
+	
+	Library() : scanning(false), progress(0), busy(0), lock(NULL), wake(NULL), next(0) {}
+	
+	static bool isrom(const string & name)
+	{
+		return name.iendsWith(".z64") or name.iendsWith(".v64") or name.iendsWith(".n64") or name.iendsWith(".zip") or name.iendsWith(".gz");
+	}
+	
+	static bool readheader(Entry & entry)
+	{
+		entry.name = notdir(entry.path);
+		entry.crc1 = entry.crc2 = entry.crc32 = 0;
+		entry.country = ' ';
+		entry.hashed = false;
+		// archives are listed by file name; their header is only seen when they're booted
+		if(entry.path.iendsWith(".zip") or entry.path.iendsWith(".gz"))
+		{
+			entry.hashed = true;
+			return true;
+		}
+		filemap map;
+		if(!map.open(entry.path, filemap::mode::read) or map.size() < sizeof(m64p_rom_header))
+			return false;
+		auto order = RomImage::detect(map.data(), map.size());
+		if(order == RomImage::Order::Unknown)
+			return false;
+		uint8_t bytes[sizeof(m64p_rom_header)];
+		RomImage::normalize(bytes, map.data(), sizeof(bytes), order);
+		m64p_rom_header header;
+		memcpy(&header, bytes, sizeof(header));
+		entry.crc1 = RomImage::big32(header.CRC1);
+		entry.crc2 = RomImage::big32(header.CRC2);
+		entry.country = bytes[0x3E];
+		char name[sizeof(header.Name)+1];
+		memcpy(name, header.Name, sizeof(header.Name));
+		name[sizeof(header.Name)] = 0;
+		string title = string(name).trim();
+		if(title != "")
+			entry.name = title;
+		return true;
+	}
+	
+	// CRC32 of the big-endian image, so it matches the usual ROM databases whatever the dump's byte order
+	static void hash(Entry & entry)
+	{
+		entry.hashed = true;
+		filemap map;
+		if(!map.open(entry.path, filemap::mode::read))
+			return;
+		auto order = RomImage::detect(map.data(), map.size());
+		if(order == RomImage::Order::Z64 or order == RomImage::Order::Unknown)
+		{
+			entry.crc32 = crc32_calculate(map.data(), map.size());
+			return;
+		}
+		uint8_t chunk[0x10000];
+		uint32_t crc = ~0;
+		for (unsigned offset = 0; offset < map.size(); offset += sizeof(chunk))
+		{
+			unsigned length = min((unsigned)sizeof(chunk), (unsigned)map.size()-offset);
+			RomImage::normalize(chunk, map.data()+offset, length, order);
+			for (unsigned i = 0; i < length; i++)
+				crc = crc32_adjust(crc, chunk[i]);
+		}
+		entry.crc32 = ~crc;
+	}
+	
+	static int walker(void * ptr)
+	{
+		Library & self = *(Library *)ptr;
+		std::vector<Entry> found;
+		while(true)
+		{
+			SDL_LockMutex(self.lock);
+			while(self.pending.empty() and self.busy > 0)
+				SDL_CondWait(self.wake, self.lock);
+			if(self.pending.empty())
+			{
+				SDL_CondBroadcast(self.wake);
+				SDL_UnlockMutex(self.lock);
+				break;
+			}
+			string folder = self.pending.back();
+			self.pending.pop_back();
+			self.busy++;
+			SDL_UnlockMutex(self.lock);
+			
+			lstring subfolders = directory::folders(folder);
+			lstring files = directory::files(folder);
+			
+			SDL_LockMutex(self.lock);
+			for (auto & name : subfolders)
+				self.pending.push_back({folder, name});
+			self.busy--;
+			SDL_CondBroadcast(self.wake);
+			SDL_UnlockMutex(self.lock);
+			
+			for (auto & name : files)
+			{
+				if(!isrom(name))
+					continue;
+				Entry entry;
+				entry.path = {folder, name};
+				entry.mtime = file::timestamp(entry.path, file::time::modify);
+				entry.size = file::size(entry.path);
+				auto known = self.previous.find(entry.path);
+				if(known != self.previous.end() and known->second->mtime == entry.mtime and known->second->size == entry.size)
+					found.push_back(*known->second);
+				else if(readheader(entry))
+					found.push_back(entry);
+				self.progress++;
+			}
+		}
+		SDL_LockMutex(self.lock);
+		self.scanned.insert(self.scanned.end(), found.begin(), found.end());
+		SDL_UnlockMutex(self.lock);
+		return 0;
+	}
+	
+	static int hasher(void * ptr)
+	{
+		Library & self = *(Library *)ptr;
+		unsigned index;
+		while((index = self.next++) < self.scanned.size())
+		{
+			if(!self.scanned[index].hashed)
+			{
+				hash(self.scanned[index]);
+				self.progress++;
+			}
+		}
+		return 0;
+	}
+	
+	static int scanscript(void * ptr)
+	{
+		Library & self = *(Library *)ptr;
+		Uint32 started = SDL_GetTicks();
+		
+		SDL_Thread * pool[threads];
+		for (unsigned i = 0; i < threads; i++)
+			pool[i] = SDL_CreateThread(walker, "LibraryWalk", &self);
+		for (unsigned i = 0; i < threads; i++)
+			SDL_WaitThread(pool[i], NULL);
+		Uint32 walked = SDL_GetTicks();
+		
+		std::sort(self.scanned.begin(), self.scanned.end(), [](const Entry & a, const Entry & b)
+		{
+			return strcasecmp(a.name, b.name) < 0;
+		});
+		self.next = 0;
+		self.progress = 0;
+		for (unsigned i = 0; i < threads; i++)
+			pool[i] = SDL_CreateThread(hasher, "LibraryHash", &self);
+		for (unsigned i = 0; i < threads; i++)
+			SDL_WaitThread(pool[i], NULL);
+		
+		self.save(self.scanned);
+		std::cout << "UI: Library scan found " << self.scanned.size() << " ROMs; listing took " << walked-started << "ms, hashing " << SDL_GetTicks()-walked << "ms.\n";
+		
+		Library * library = &self;
+		uiqueue.post(UIQueue::Key::None, [library]()
+		{
+			library->entries.swap(library->scanned);
+			library->scanned.clear();
+			library->previous.clear();
+			library->scanning = false;
+			library->finished();
+		});
+		return 0;
+	}
 	
-    API::CoreDoCommand(M64CMD_EXECUTE, 0, NULL);
-    std::cout << "UI: Emulation ended.\n";
-    API::CoreDoCommand(M64CMD_ROM_CLOSE, 0, NULL);
-    std::cout << "UI: Did close ROM.\n";
-    
-    auto err2 = M64ERR_SUCCESS;
-    
-    err = API::CoreDetachPlugin(RSPType);
-    if(err != M64ERR_SUCCESS)
-    {
-        std::cout << "RSP plugin errored while detaching: " << err;
-        err2 = err;
-    }
-    err = API::CoreDetachPlugin(InputType);
-    if(err != M64ERR_SUCCESS)
-    {
-        std::cout << "Input plugin errored while detaching: " << err;
-        err2 = err;
-    }
-    err = API::CoreDetachPlugin(AudioType);
-    if(err != M64ERR_SUCCESS)
-    {
-        std::cout << "Audio plugin errored while detaching: " << err;
-        err2 = err;
-    }
-    err = API::CoreDetachPlugin(VideoType);
-    if(err != M64ERR_SUCCESS)
-    {
-        std::cout << "Video plugin errored while detaching: " << err;
-        err2 = err;
-    }
-    //m64p_error CoreDoCommand(m64p_command Command, int ParamInt, void *ParamPtr)
-    
-    if(err2 == M64ERR_SUCCESS)
-        std::cout << "UI: Did detach all plugins; cleaning state, closing thread.\n";
-    
-    mainwin->btn_pauser.onActivate = mainwin->do_play;
-    mainwin->btn_load.onActivate = mainwin->do_loadrom;
-    mainwin->btn_load.setText("Load ROM");
-    corethread = NULL;
-    
-    std::cout << "UI: Core quit.\n";
-    
-    return 0;
-}
+	// Starts a background rescan of folders. finished runs on the GUI thread once entries has been replaced.
+	bool scan(const nall::function<void()> & finished)
+	{
+		if(scanning)
+			return false;
+		if(!lock)
+		{
+			lock = SDL_CreateMutex();
+			wake = SDL_CreateCond();
+		}
+		scanning = true;
+		progress = 0;
+		scanned.clear();
+		previous.clear();
+		for (auto & entry : entries)
+			previous[entry.path] = &entry;
+		pending.clear();
+		for (auto & folder : folders)
+		{
+			string path = folder;
+			path.transform("\\", "/");
+			if(!path.endsWith("/"))
+				path.append("/");
+			pending.push_back(path);
+		}
+		busy = 0;
+		
+		this->finished = finished;
+		SDL_Thread * thread = SDL_CreateThread(scanscript, "LibraryScan", this);
+		SDL_DetachThread(thread);
+		return true;
+	}
+	
+	bool load()
+	{
+		file input;
+		if(!input.open("library.idx", file::mode::read))
+			return false;
+		string magic;
+		for (unsigned i = 0; i < 14; i++)
+			magic.append((char)input.read());
+		if(magic != "panui-library\n")
+			return false;
+		folders.reset();
+		for (unsigned count = input.readl(2); count and !input.end(); count--)
+			folders.append(readtext(input));
+		entries.clear();
+		unsigned count = input.readl(4);
+		entries.reserve(count);
+		for (; count and !input.end(); count--)
+		{
+			Entry entry;
+			entry.path = readtext(input);
+			entry.mtime = input.readl(8);
+			entry.size = input.readl(8);
+			entry.name = readtext(input);
+			entry.crc1 = input.readl(4);
+			entry.crc2 = input.readl(4);
+			entry.crc32 = input.readl(4);
+			entry.country = input.read();
+			entry.hashed = input.read();
+			entries.push_back(entry);
+		}
+		return true;
+	}
+	
+	// written to a temporary name first so an interrupted save doesn't lose the old index
+	bool save(const std::vector<Entry> & list)
+	{
+		file output;
+		if(!output.open("library.idx.tmp", file::mode::write))
+			return false;
+		output.print("panui-library\n");
+		output.writel(folders.size(), 2);
+		for (auto & folder : folders)
+			writetext(output, folder);
+		output.writel(list.size(), 4);
+		for (auto & entry : list)
+		{
+			writetext(output, entry.path);
+			output.writel(entry.mtime, 8);
+			output.writel(entry.size, 8);
+			writetext(output, entry.name);
+			output.writel(entry.crc1, 4);
+			output.writel(entry.crc2, 4);
+			output.writel(entry.crc32, 4);
+			output.write(entry.country);
+			output.write(entry.hashed);
+		}
+		output.close();
+		file::remove("library.idx");
+		return file::move("library.idx.tmp", "library.idx");
+	}
+} library;
 
-int subbootscript( void * ptr )
+struct LibraryWindow : Window
 {
-	std::cout << "UI: Started core threads -- waiting on full load.\n";
-	while(romthread)
-		SDL_Delay(10);
+	FixedLayout layout;
+	LineEdit folders;
+	Button btn_scan;
+	Label status;
+	ListView list;
+	Timer timer;
+	MainWindow * parent;
+	void refresh();
+	LibraryWindow(MainWindow * arg_parent);
+};
+
+LibraryWindow::LibraryWindow(MainWindow * arg_parent)
+{
+	parent = arg_parent;
+	setTitle("Library");
 	
-	auto time = SDL_GetTicks();
-    while(API::CoreDoCommand(M64CMD_RESUME, 0, NULL) != M64ERR_SUCCESS and SDL_GetTicks()-time < 2000)
-		SDL_Delay(10);
-	if(SDL_GetTicks()-time >= 2000)
-		std::cout << "UI: Core locked up for two seconds, you're on your own.\n";
+	folders.setText(library.folders.merge(";"));
 	
-	if(API::DebugSetRunState(2) == M64ERR_SUCCESS)
+	list.setHeaderText({"Name", "Region", "CRC", "CRC32", "File"});
+	list.setHeaderVisible();
+	list.onActivate = [this]()
 	{
-		std::cout << "UI: Core seemed to allow setting debug run state.\n";
-		if(API::DebugStep() != M64ERR_SUCCESS)
-			std::cout << "UI: Failed to finish resuming emulation.\n";
-		else
+		if(!list.selected() or list.selection() >= library.entries.size())
+			return;
+		parent->libraryrom = library.entries[list.selection()].path;
+		parent->do_loadrom();
+	};
+	
+	btn_scan.setText("Scan");
+	btn_scan.onActivate = [this]()
+	{
+		if(library.scanning)
+			return;
+		library.folders = folders.text().split(";");
+		for (unsigned i = library.folders.size(); i-- > 0;)
 		{
-			std::cout << "UI: Finished loading ROM and initializing emulator.\n";
-			((MainWindow*)ptr)->win_debugger->setVisible(true);
-			((MainWindow*)ptr)->win_debugger->visible = true;
+			if(library.folders[i].trim() == "")
+				library.folders.remove(i);
 		}
-	}
-	else
-		std::cout << "UI: Core does not seem to be built with debugging enabled.\n";
+		if(!library.scan([this]() { refresh(); }))
+			return;
+		timer.setEnabled(true);
+	};
 	
-	return 0;
+	timer.setInterval(250);
+	timer.onActivate = [this]()
+	{
+		if(library.scanning)
+			status.setText({"Scanning... ", library.progress.load(), " files"});
+	};
+	
+	layout.append(folders,  Geometry{10       , 10     , 380, 24});
+	layout.append(btn_scan, Geometry{10+380+4 , 10     , 56 , 24});
+	layout.append(status,   Geometry{10       , 10+24+4, 440, 24});
+	layout.append(list,     Geometry{10       , 10+(24+4)*2, 440, 400});
+	append(layout);
+	
+	setGeometry({128, 128, 460, 10+(24+4)*2+400+10});
+	setResizable(false);
+	setVisible(false);
+}
+
+void LibraryWindow::refresh()
+{
+	timer.setEnabled(false);
+	list.reset();
+	for (auto & entry : library.entries)
+	{
+		lstring row;
+		row.append(entry.name);
+		row.append(string{""}.append(entry.country));
+		row.append(entry.crc1 ? string{hex<8>(entry.crc1), "-", hex<8>(entry.crc2)} : string{""});
+		row.append(entry.crc32 ? string{hex<8>(entry.crc32)} : string{""});
+		row.append(notdir(entry.path));
+		list.append(row);
+	}
+	list.autoSizeColumns();
+	status.setText({library.entries.size(), " ROMs"});
 }
 
 int loadrom (string arg_romname)
@@ -442,34 +5279,75 @@ int loadrom (string arg_romname)
     {
         std::cout << "UI: Bad romname, returning.\n";
         corethread = NULL;
+        controller.rom(false);
         return 0;
     }
     romname = arg_romname;
     
     char * cstr_romname = arg_romname.data();
     std::cout << "UI: ROM cstring: " << cstr_romname << "\n";
-    file romfile(cstr_romname, file::mode::read);
-    
-    API::romdata = (uint8_t *)malloc(romfile.size());
-    API::romsize = romfile.size();
+    if(!rom.load(arg_romname))
+    {
+        std::cout << "UI: Could not read ROM.\n";
+        controller.rom(false);
+        return 0;
+    }
     
-    romfile.read(API::romdata, API::romsize);
+    API::romdata = rom.data;
+    API::romsize = rom.size;
+    // PAL and MPAL carts run at 50 VIs a second
+    char region = rom.size > 0x3E ? rom.data[0x3E] : 'E';
+    frametiming.rate = region and strchr("DFIPSUXYL", region) ? 50 : 60;
+    rewinder.stale = true;
+    controller.rom(true);
+    return 1;
 }
 
 int romscript( void * window )
 {
-    romname = ((MainWindow *)window)->browser.setParent(*((MainWindow *)window)).setFilters("n64 roms (*.n64,*.z64,*.v64)").open();
+    MainWindow * mainwin = (MainWindow *)window;
+    if(mainwin->libraryrom != "")
+        romname = mainwin->libraryrom;
+    else
+        romname = mainwin->browser.setParent(*mainwin).setFilters("n64 roms (*.n64,*.z64,*.v64,*.zip,*.gz)").open();
+    mainwin->libraryrom = "";
     loadrom(romname);
     
     romthread = NULL;
+    romloading = false;
     return 0;
 }
 
+// The video window belongs to the core's own SDL2.dll, which panui's statically linked SDL knows nothing
+// about, so ask Windows whether the foreground window is one of this process's instead.
+bool foreground()
+{
+    #if defined(PLATFORM_WINDOWS)
+    DWORD pid = 0;
+    GetWindowThreadProcessId(GetForegroundWindow(), &pid);
+    return pid == GetCurrentProcessId();
+    #else
+    return false;
+    #endif
+}
+
 MainWindow::MainWindow()
 {
 	setTitle("Panui");
     win_options = new Options(this);
+    // savestates is declared after Options
+    win_options->dedupe.onToggle = [this]()
+    {
+        savestates.dedupe = win_options->dedupe.checked();
+    };
     win_debugger = new Debugger(this);
+    library.load();
+    win_slots = new SlotWindow;
+    win_library = new LibraryWindow(this);
+    win_library->refresh();
+    // the saved index is shown right away; the rescan only replaces it once it's done
+    if(library.folders.size())
+        library.scan([this]() { win_library->refresh(); });
     do_play = [this]()
     {
         if(corethread and this->paused)
@@ -496,18 +5374,26 @@ MainWindow::MainWindow()
     };
     do_loadrom  = [this]()
     {
-        if(romthread or corethread)
+        // a library pick only counts for the load it was made for
+        if(romloading or corethread)
+        {
+            libraryrom = "";
             return;
+        }
         
         getcwd(working_dir, PATH_MAX);
         if(!working_dir)
         {
             std::cout << "UI: Error caching current directory.";
+            libraryrom = "";
             return;
         }
 
-        romthread = SDL_CreateThread(romscript, "RomScript", this);
-        //romthread is Wait-ed in corethread
+        controller.set(CoreController::State::Loading);
+        romloading = true;
+        SDL_Thread * thread = SDL_CreateThread(romscript, "RomScript", this);
+        romthread = thread;
+        SDL_DetachThread(thread); // bootscript waits on the controller, not the thread
         corethread = SDL_CreateThread(bootscript, "BootScript", this);
         SDL_DetachThread(corethread);
 		
@@ -529,7 +5415,7 @@ MainWindow::MainWindow()
         else
             std::cout << "UI: No corethread in do_stop\n";
     };
-    setGeometry({64, 64, 10+128+4+80+10, 10+24*3+4*2+10});
+    setGeometry({64, 64, 10+128+4+80+10, 10+24*4+4*4+20+10});
     
     paused = true;
     
@@ -544,15 +5430,38 @@ MainWindow::MainWindow()
         this->win_options->setVisible(!this->win_options->visible());
     };
     
+    btn_library.setText("Library");
+    btn_library.onActivate = [this]()
+    {
+        this->win_library->setVisible(!this->win_library->visible());
+    };
+    
     btn_save.setText("Save");
     btn_save.onActivate = [this]()
     {
-        API::CoreDoCommand(M64CMD_STATE_SAVE, 0, NULL);
+        if(!savestates.save())
+            std::cout << "UI: Can't save state right now.\n";
     };
     btn_restore.setText("Load");
     btn_restore.onActivate = [this]()
     {
-        API::CoreDoCommand(M64CMD_STATE_LOAD, 0, NULL);
+        savestates.load();
+    };
+    btn_slots.setText("Slots");
+    btn_slots.onActivate = [this]()
+    {
+        if(!this->win_slots->visible())
+            this->win_slots->refresh();
+        this->win_slots->setVisible(!this->win_slots->visible());
+    };
+    btn_record.setText("Record");
+    btn_record.onActivate = [this]()
+    {
+        if(capture.encoder)
+            capture.stop();
+        else if(!capture.start())
+            std::cout << "UI: Could not start recording.\n";
+        btn_record.setText(capture.encoder ? "Stop Recording" : "Record");
     };
     
     img_play.load("play.png");
@@ -561,11 +5470,70 @@ MainWindow::MainWindow()
     btn_pauser.onActivate = do_play;
     btn_pauser.setImage(img_play, Orientation::Vertical);
     
+    uitimer.setInterval(10);
+    uitimer.onActivate = [this]()
+    {
+        uiqueue.drain();
+        // Keyboard::pressed sees keys typed into any window, so only react while one of our windows (this one
+        // or the video plugin's) is in the foreground; Alt-Tab shouldn't fast-forward on its way out either
+        bool focus = focused() or foreground();
+        bool alt = Keyboard::pressed(Keyboard::Scancode::AltLeft) or Keyboard::pressed(Keyboard::Scancode::AltRight);
+        fastforward.update(focus and !alt and Keyboard::pressed(Keyboard::Scancode::Tab));
+        rewinder.hold(focus and Keyboard::pressed(Keyboard::Scancode::Backspace));
+    };
+    uitimer.setEnabled();
+    
+    // once a second: min/avg/p99/max frame time and speed, plus a CSV row when enabled in the options
+    timingtimer.setInterval(1000);
+    timingtimer.onActivate = [this]()
+    {
+        FrameTiming::Summary frame, vi;
+        double speed;
+        frametiming.sample(frame, vi, speed);
+        if(capture.encoder and capture.dropped)
+            btn_record.setText({"Stop Recording (", capture.dropped.load(), " dropped)"});
+        else
+            btn_record.setText(capture.encoder ? "Stop Recording" : "Record");
+        if(controller.get() != CoreController::State::Running or !frame.count)
+        {
+            timing.setText("");
+            return;
+        }
+        auto tenths = [](double value) -> string
+        {
+            unsigned scaled = value*10+0.5;
+            return {scaled/10, ".", scaled%10};
+        };
+        timing.setText({tenths(frame.min), "/", tenths(frame.avg), "/", tenths(frame.p99), "/", tenths(frame.max), "ms ", (unsigned)(speed+0.5), "%"});
+        
+        if(!win_options->timinglog.checked())
+        {
+            timinglog.close();
+            return;
+        }
+        if(!timinglog.open())
+        {
+            bool fresh = !file::exists("frametiming.csv");
+            if(!openappend(timinglog, "frametiming.csv"))
+                return;
+            if(fresh)
+                timinglog.print("ticks,frames,frame_min_ms,frame_avg_ms,frame_p99_ms,frame_max_ms,vis,vi_avg_ms,vi_p99_ms,speed_percent\n");
+        }
+        timinglog.print(SDL_GetTicks(), ",", frame.count, ",", tenths(frame.min), ",", tenths(frame.avg), ",", tenths(frame.p99), ",", tenths(frame.max), ",",
+                        vi.count, ",", tenths(vi.avg), ",", tenths(vi.p99), ",", tenths(speed), "\n");
+        timinglog.flush();
+    };
+    timingtimer.setEnabled();
+    
     layout.append(btn_load,    Geometry{10      , 10         , 128 , 24});
-    layout.append(btn_options, Geometry{10      , 10+ 24+4   , 128 , 24});
-    layout.append(btn_save,    Geometry{10      , 10+(24+4)*2, 64-2, 24});
-    layout.append(btn_restore, Geometry{10+64+2 , 10+(24+4)*2, 64-2, 24});
+    layout.append(btn_options, Geometry{10      , 10+ 24+4   , 64-2, 24});
+    layout.append(btn_library, Geometry{10+64+2 , 10+ 24+4   , 64-2, 24});
+    layout.append(btn_save,    Geometry{10      , 10+(24+4)*2, 40  , 24});
+    layout.append(btn_restore, Geometry{10+44   , 10+(24+4)*2, 40  , 24});
+    layout.append(btn_slots,   Geometry{10+88   , 10+(24+4)*2, 40  , 24});
+    layout.append(btn_record,  Geometry{10      , 10+(24+4)*3, 128 , 24});
     layout.append(btn_pauser,  Geometry{10+128+4, 10         , 80  , 80});
+    layout.append(timing,      Geometry{10      , 10+(24+4)*4, 128+4+80, 20});
     append(layout);
 
     onClose = &Application::quit;
@@ -574,173 +5542,310 @@ MainWindow::MainWindow()
     setVisible(); // must be after setResizable()
 }
 
-int main(int argc, char *argv[])
+// Loads the core library, starts it up and binds everything panui calls; NULL on failure.
+void * loadcore ( const char * filename )
 {
-    // GET SHIT RUNNING (aka everything is currently hardcoded)
-    
-    // core
-    
-    romname = "";
-    romthread = NULL;
-    
-    void * core = SDL_LoadObject("mupen64plus.dll");
+    frametiming.frequency = SDL_GetPerformanceFrequency();
+    void * core = SDL_LoadObject(filename);
     std::cout << SDL_GetError();
     if(!core)
-        return 0;
+        return NULL;
     
 	if(API::LoadFunction<ptr_CoreGetAPIVersions>(&API::CoreGetAPIVersions, "CoreGetAPIVersions", core))
-		return 0;
+		return NULL;
 	
     int VersionConfig, VersionDebug, VersionVidext, VersionExtra;
     API::CoreGetAPIVersions(&VersionConfig, &VersionDebug, &VersionVidext, &VersionExtra);
     
 	if(API::LoadFunction<ptr_CoreStartup>(&API::CoreStartup, "CoreStartup", core))
-        return 0;
+        return NULL;
     
-    API::CoreStartup(0x020000, ".", NULL, (void *)"Core", &debug, NULL, NULL);
+    controller.initialize();
+    API::CoreStartup(0x020000, ".", NULL, (void *)"Core", &debug, NULL, &corestate);
     
     if(API::LoadFunction<ptr_CoreAttachPlugin>(&API::CoreAttachPlugin, "CoreAttachPlugin", core))
-        return 0;
+        return NULL;
     
     if(API::LoadFunction<ptr_CoreDetachPlugin>(&API::CoreDetachPlugin, "CoreDetachPlugin", core))
-        return 0;
+        return NULL;
     
     if(API::LoadFunction<ptr_CoreDoCommand>(&API::CoreDoCommand, "CoreDoCommand", core))
-        return 0;
+        return NULL;
         
     if(API::LoadFunction<ptr_DebugSetCallbacks>(&API::DebugSetCallbacks, "DebugSetCallbacks", core))
-        return 0;
-    API::DebugSetCallbacks(NULL, NULL, NULL);
+        return NULL;
+    API::DebugSetCallbacks(NULL, &dbg_update, &dbg_vi);
+    API::CoreDoCommand(M64CMD_SET_FRAME_CALLBACK, 0, (void *)&framecallback);
 	
     if(API::LoadFunction<ptr_DebugSetRunState>(&API::DebugSetRunState, "DebugSetRunState", core))
-        return 0;
+        return NULL;
     if(API::LoadFunction<ptr_DebugGetState>(&API::DebugGetState, "DebugGetState", core))
-        return 0;
+        return NULL;
     if(API::LoadFunction<ptr_DebugStep>(&API::DebugStep, "DebugStep", core))
-        return 0;
+        return NULL;
     if(API::LoadFunction<ptr_DebugMemGetPointer>(&API::DebugMemGetPointer, "DebugMemGetPointer", core))
-        return 0;
+        return NULL;
     if(API::LoadFunction<ptr_DebugMemRead32>(&API::DebugMemRead32, "DebugMemRead32", core))
-        return 0;
+        return NULL;
+    if(API::LoadFunction<ptr_DebugMemWrite8>(&API::DebugMemWrite8, "DebugMemWrite8", core))
+        return NULL;
+    if(API::LoadFunction<ptr_DebugGetCPUDataPtr>(&API::DebugGetCPUDataPtr, "DebugGetCPUDataPtr", core))
+        return NULL;
+    if(API::LoadFunction<ptr_DebugMemWrite32>(&API::DebugMemWrite32, "DebugMemWrite32", core))
+        return NULL;
+    if(API::LoadFunction<ptr_DebugDecodeOp>(&API::DebugDecodeOp, "DebugDecodeOp", core))
+        return NULL;
+    if(API::LoadFunction<ptr_DebugMemGetMemInfo>(&API::DebugMemGetMemInfo, "DebugMemGetMemInfo", core))
+        return NULL;
+    if(API::LoadFunction<ptr_DebugMemGetRecompInfo>(&API::DebugMemGetRecompInfo, "DebugMemGetRecompInfo", core))
+        return NULL;
+    if(API::LoadFunction<ptr_DebugBreakpointCommand>(&API::DebugBreakpointCommand, "DebugBreakpointCommand", core))
+        return NULL;
+    return core;
+}
+
+bool BatchRun::parse(int argc, char * argv[])
+{
+	for (int i = 2; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool last = i+1 >= argc;
+		if(arg == "--core" and !last)
+			corename = argv[++i];
+		else if(arg == "--video" and !last)
+			video = argv[++i];
+		else if(arg == "--frames" and !last)
+			frames = decimal(argv[++i]);
+		else if(arg == "--jobs" and !last)
+			jobs = decimal(argv[++i]);
+		else if(arg == "--timeout" and !last)
+			timeout = decimal(argv[++i]);
+		else if(arg == "--at" and !last)
+		{
+			for (auto & number : string(argv[++i]).split(","))
+				at.push_back(decimal(number));
+			std::sort(at.begin(), at.end());
+		}
+		else if(arg.beginsWith("--"))
+		{
+			std::cout << "UI: Unknown batch option " << argv[i] << "\n";
+			return false;
+		}
+		else
+			roms.append(arg);
+	}
+	if(roms.size() == 0)
+	{
+		std::cout << "usage: panui --batch [--core lib] [--video lib] [--frames n] [--at n,n,...] [--jobs n] [--timeout ms] roms...\n";
+		return false;
+	}
+	return true;
+}
+
+// everything a worker needs, in the form parse() reads
+string BatchRun::options() const
+{
+	string text = {" --core \"", corename, "\" --frames ", frames, " --timeout ", timeout};
+	if(video != "")
+		text.append(" --video \"", video, "\"");
+	if(at.size())
+	{
+		text.append(" --at ");
+		for (unsigned i = 0; i < at.size(); i++)
+			text.append(i ? "," : "", at[i]);
+	}
+	return text;
+}
+
+// Stops a worker that runs past its time limit, leaving work() to report it. Only a core that ignores
+// M64CMD_STOP too gets the whole process taken down.
+int BatchRun::watchdog(void * ptr)
+{
+	BatchRun & self = *(BatchRun *)ptr;
+	Uint32 deadline = SDL_GetTicks()+self.timeout;
+	while(self.executing and SDL_GetTicks() < deadline)
+		SDL_Delay(50);
+	if(!self.executing)
+		return 0;
+	self.timedout = true;
+	self.active = false;
+	API::CoreDoCommand(M64CMD_STOP, 0, NULL);
+	deadline = SDL_GetTicks()+5000;
+	while(self.executing and SDL_GetTicks() < deadline)
+		SDL_Delay(50);
+	if(!self.executing)
+		return 0;
+	std::cout << "RESULT\t" << (const char *)self.roms[0] << "\thung\t" << self.count << "\t" << self.timeout << "\t\n";
+	std::cout.flush();
+	_exit(3);
+	return 0;
+}
+
+int BatchRun::work()
+{
+	string & path = roms[0];
+	Uint32 begin = SDL_GetTicks();
+	status = "unreadable";
+	void * core = loadcore(corename);
+	if(!core)
+		status = "no-core";
+	else
+	{
+		plugins.core = core;
+		plugins.lock = SDL_CreateMutex();
+		if(!plugins.discover(".", video) or !plugins.start())
+			status = "no-plugins";
+		else if(rom.load(path))
+		{
+			if(API::CoreDoCommand(M64CMD_ROM_OPEN, rom.size, rom.data) != M64ERR_SUCCESS)
+				status = "rom-open";
+			else
+			{
+				if(plugins.attach() != M64ERR_SUCCESS)
+					status = "attach";
+				else
+				{
+					int limiter = 0;
+					API::CoreDoCommand(M64CMD_CORE_STATE_SET, M64CORE_SPEED_LIMITER, &limiter);
+					status = "ended";
+					begin = SDL_GetTicks();
+					active = true;
+					executing = true;
+					SDL_Thread * dog = SDL_CreateThread(watchdog, "BatchWatchdog", this);
+					API::CoreDoCommand(M64CMD_EXECUTE, 0, NULL);
+					executing = false;
+					active = false;
+					SDL_WaitThread(dog, NULL);
+					// status is only written on this thread; a run that finished just in time still counts
+					if(timedout and status != "ok")
+						status = "timeout";
+					plugins.detach();
+				}
+				API::CoreDoCommand(M64CMD_ROM_CLOSE, 0, NULL);
+			}
+			rom.close();
+		}
+	}
+	std::cout << "RESULT\t" << (const char *)path << "\t" << (const char *)status << "\t" << count << "\t" << SDL_GetTicks()-begin << "\t" << (const char *)hashes.merge(",") << "\n";
+	std::cout.flush();
+	return status == "ok" ? 0 : 1;
+}
+
+int BatchRun::jobscript(void * ptr)
+{
+	Job & job = *(Job *)ptr;
+	unsigned index;
+	while((index = (*job.next)++) < job.self->roms.size())
+	{
+		string command = {"\"", job.program, "\" --batch-worker", job.self->options(), " \"", job.self->roms[index], "\""};
+		// popen goes through cmd.exe, which strips the first and last quote when the line starts with one
+		command = {"\"", command, "\""};
+		FILE * worker = popen(command, "r");
+		string result = {job.self->roms[index], "\tfailed\t0\t0\t"};
+		if(worker)
+		{
+			char line[4096];
+			while(fgets(line, sizeof(line), worker))
+			{
+				string text = line;
+				if(text.beginsWith("RESULT\t"))
+					result = text.slice(7).rtrim("\n").rtrim("\r");
+			}
+			pclose(worker);
+		}
+		(*job.results)[index] = result;
+	}
+	return 0;
+}
+
+int BatchRun::coordinate(const char * self)
+{
+	if(jobs == 0)
+		jobs = max(1, SDL_GetCPUCount());
+	unsigned count = min(jobs, roms.size());
+	std::atomic<unsigned> next(0);
+	lstring results;
+	for (unsigned i = 0; i < roms.size(); i++)
+		results.append("");
 	
-    // Video
-    const char * dllname = "";
-    if(argc > 1)
-        dllname = argv[1];
-    else
-        dllname = "mupen64plus-video-glide64mk2.dll";
-    API::Video = SDL_LoadObject(dllname);
-    std::cout << SDL_GetError();
-    if(!API::Video)
-        return 0;
-    
-    if(API::LoadFunction<ptr_PluginStartup>(&API::VideoStartup, "PluginStartup", API::Video))
-    {
-        std::cout << "Video plugin is not a valid m64p plugin (no startup).";
-        return 0;
-    }
-    
-    if(API::LoadFunction<ptr_PluginGetVersion>(&API::VideoVersion, "PluginGetVersion", API::Video))
-    {
-        std::cout << "Video plugin is not a valid m64p plugin (no version).";
-        return 0;
-    }
-    
-    m64p_error err = API::VideoStartup(core, (void *)"Video", &debug);
-    if(err)
-    {
-        std::cout << "Video plugin errored while starting up: " << err;
-        return 0;
-    }
-    
-    // Audio
-    
-    API::Audio = SDL_LoadObject("mupen64plus-audio-sdl.dll");
-    std::cout << SDL_GetError();
-    if(!API::Audio)
-        return 0;
-    
-    if(API::LoadFunction<ptr_PluginStartup>(&API::AudioStartup, "PluginStartup", API::Audio))
-    {
-        std::cout << "Audio plugin is not a valid m64p plugin (no startup).";
-        return 0;
-    }
-    
-    if(API::LoadFunction<ptr_PluginGetVersion>(&API::AudioVersion, "PluginGetVersion", API::Audio))
-    {
-        std::cout << "Audio plugin is not a valid m64p plugin (no version).";
-        return 0;
-    }
-    
-    err = API::AudioStartup(core, (void *)"Audio", &debug);
-    if(err)
-    {
-        std::cout << "Audio plugin errored while starting up: " << err;
-        return 0;
-    }
-    
-    // Input
-    
-    API::Input = SDL_LoadObject("mupen64plus-Input-sdl.dll");
-    std::cout << SDL_GetError();
-    if(!API::Input)
-        return 0;
-    
-    if(API::LoadFunction<ptr_PluginStartup>(&API::InputStartup, "PluginStartup", API::Input))
-    {
-        std::cout << "Input plugin is not a valid m64p plugin (no startup).";
-        return 0;
-    }
+	Job job = {this, self, &next, &results};
+	Uint32 begin = SDL_GetTicks();
+	std::vector<SDL_Thread *> pool;
+	for (unsigned i = 0; i < count; i++)
+		pool.push_back(SDL_CreateThread(jobscript, "BatchJob", &job));
+	for (auto thread : pool)
+		SDL_WaitThread(thread, NULL);
+	
+	auto pad = [](string text, unsigned width) -> string
+	{
+		while(text.length() < width)
+			text.append(" ");
+		return text;
+	};
+	unsigned namewidth = 3;
+	for (auto & rom : roms)
+		namewidth = max(namewidth, notdir(rom).length());
+	std::cout << (const char *)pad("ROM", namewidth) << "  " << (const char *)pad("Status", 10) << "  Frames  Time (ms)  Screens\n";
+	unsigned failures = 0;
+	for (auto & result : results)
+	{
+		lstring fields = result.split("\t");
+		while(fields.size() < 5)
+			fields.append("");
+		failures += fields[1] != "ok";
+		std::cout << (const char *)pad(notdir(fields[0]), namewidth) << "  " << (const char *)pad(fields[1], 10) << "  " << (const char *)pad(fields[2], 6)
+		          << "  " << (const char *)pad(fields[3], 9) << "  " << (const char *)fields[4] << "\n";
+	}
+	std::cout << roms.size() << " ROMs, " << failures << " failed, " << SDL_GetTicks()-begin << "ms on " << count << " workers.\n";
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // GET SHIT RUNNING (aka everything is currently hardcoded)
     
-    if(API::LoadFunction<ptr_PluginGetVersion>(&API::InputVersion, "PluginGetVersion", API::Input))
-    {
-        std::cout << "Input plugin is not a valid m64p plugin (no version).";
-        return 0;
-    }
+    // core
     
+    romname = "";
+    romthread = NULL;
+    romloading = false;
     
-    err = API::InputStartup(core, (void *)"Input", &debug);
-    if(err)
+    if(argc > 1 and (string(argv[1]) == "--batch" or string(argv[1]) == "--batch-worker"))
     {
-        std::cout << "Input plugin errored while starting up: " << err;
-        return 0;
+        if(!batch.parse(argc, argv))
+            return 2;
+        if(string(argv[1]) == "--batch-worker")
+            return batch.work();
+        return batch.coordinate(argv[0]);
     }
     
-    // RSP
-    
-    API::RSP = SDL_LoadObject("mupen64plus-rsp-hle.dll");
-    std::cout << SDL_GetError();
-    if(!API::RSP)
-        return 0;
-    
-    if(API::LoadFunction<ptr_PluginStartup>(&API::RSPStartup, "PluginStartup", API::RSP))
-    {
-        std::cout << "RSP plugin is not a valid m64p plugin (no startup).";
+    Uint32 launched = SDL_GetTicks();
+    void * core = loadcore("mupen64plus.dll");
+    if(!core)
         return 0;
-    }
+    Uint32 bound = SDL_GetTicks();
     
-    if(API::LoadFunction<ptr_PluginGetVersion>(&API::RSPVersion, "PluginGetVersion", API::RSP))
-    {
-        std::cout << "RSP plugin is not a valid m64p plugin (no version).";
-        return 0;
-    }
+    // plugins
     
-    err = API::RSPStartup(core, (void *)"RSP", &debug);
-    if(err)
-    {
-        std::cout << "RSP plugin errored while starting up: " << err;
+    plugins.core = core;
+    plugins.lock = SDL_CreateMutex();
+    if(!plugins.discover(".", argc > 1 ? string(argv[1]) : string("")))
         return 0;
-    }
+    Uint32 discovered = SDL_GetTicks();
     
     // window
     
-    std::cout << "UI: Did startup all plugins.\n";
-    
+    savestates.initialize();
     MainWindow * w = new MainWindow;
+    Uint32 shown = SDL_GetTicks();
+    std::cout << "UI: Startup took " << shown-launched << "ms: core " << bound-launched << "ms, plugin discovery "
+              << discovered-bound << "ms, window " << shown-discovered << "ms.\n";
+    SDL_DetachThread(SDL_CreateThread(Plugins::startscript, "PluginStartup", &plugins));
     
     if(argc > 2)
     {
         std::cout << "UI: Found ROM on command line, loading: " << argv[2] << "\n";
+        controller.set(CoreController::State::Loading);
         loadrom(string(argv[2]));
         corethread = SDL_CreateThread(bootscript, "BootScript", w);
     }
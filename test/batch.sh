@@ -0,0 +1,43 @@
+#!/bin/bash
+# Batch mode smoke test against the stub core (make stubs). A normal ROM has to finish with the same
+# screen hashes twice, one that never draws a frame has to be reported as a timeout, and one whose
+# core ignores STOP as hung.
+cd "$(dirname "$0")"
+
+makerom() # file, header name
+{
+	head -c 4096 /dev/zero > "$1"
+	printf '\x80\x37\x12\x40' | dd of="$1" conv=notrunc status=none
+	printf '%s' "$2" | dd of="$1" bs=1 seek=32 conv=notrunc status=none
+}
+makerom good.z64 GOOD
+makerom hang.z64 HANG
+makerom deaf.z64 DEAF
+
+run()
+{
+	../panui --batch --core ./stubcore.dll --frames 120 --at 30,60 --timeout 2000 --jobs 3 good.z64 hang.z64 deaf.z64
+}
+run > batch1.log
+run > batch2.log
+cat batch1.log
+
+failed=0
+check() # file, status
+{
+	if ! grep -q "^$1 *$2 " batch1.log; then
+		echo "FAIL: expected $1 to be $2"
+		failed=1
+	fi
+}
+check good.z64 ok
+check hang.z64 timeout
+check deaf.z64 hung
+if [ "$(grep '^good.z64' batch1.log | awk '{print $3, $5}')" != "$(grep '^good.z64' batch2.log | awk '{print $3, $5}')" ]; then
+	echo "FAIL: screen hashes differ between runs"
+	failed=1
+fi
+
+rm -f good.z64 hang.z64 deaf.z64 batch1.log batch2.log plugins.idx
+[ $failed = 0 ] && echo "batch test passed"
+exit $failed
@@ -0,0 +1,167 @@
+// Stand-in for the mupen64plus core (and, built with -DSTUB_PLUGIN=type, for a plugin) so batch mode
+// can be exercised without emulating anything. EXECUTE calls the frame callback in a loop until STOP
+// and READ_SCREEN returns a pattern that depends only on the frame number, so screen hashes are stable.
+// ROMs whose header name starts with HANG never produce a frame; DEAF ones also ignore STOP.
+
+#define M64P_CORE_PROTOTYPES
+#include <mupen/m64p_common.h>
+#include <mupen/m64p_frontend.h>
+#include <mupen/m64p_types.h>
+#include <mupen/m64p_debugger.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string.h>
+
+#if defined(STUB_PLUGIN)
+
+EXPORT m64p_error CALL PluginGetVersion(m64p_plugin_type * type, int * version, int * api, const char ** name, int * caps)
+{
+	if(type) *type = (m64p_plugin_type)STUB_PLUGIN;
+	if(version) *version = 0x010000;
+	if(api) *api = 0x020000;
+	if(name) *name = "panui stub plugin";
+	if(caps) *caps = 0;
+	return M64ERR_SUCCESS;
+}
+EXPORT m64p_error CALL PluginStartup(m64p_dynlib_handle, void *, void (*)(void *, int, const char *)) { return M64ERR_SUCCESS; }
+EXPORT m64p_error CALL PluginShutdown(void) { return M64ERR_SUCCESS; }
+
+#else
+
+static const unsigned width = 320;
+static const unsigned height = 240;
+static char romname[21];
+static bool romopen = false;
+static std::atomic<bool> stopping(false);
+static std::atomic<unsigned> frame(0);
+static m64p_frame_callback framecallback = NULL;
+static ptr_StateCallback statecallback = NULL;
+static void * statecontext = NULL;
+
+static void setstate(m64p_emu_state state)
+{
+	if(statecallback)
+		statecallback(statecontext, M64CORE_EMU_STATE, state);
+}
+
+EXPORT m64p_error CALL PluginGetVersion(m64p_plugin_type * type, int * version, int * api, const char ** name, int * caps)
+{
+	if(type) *type = M64PLUGIN_CORE;
+	if(version) *version = 0x020000;
+	if(api) *api = 0x020001;
+	if(name) *name = "panui stub core";
+	if(caps) *caps = 0;
+	return M64ERR_SUCCESS;
+}
+EXPORT m64p_error CALL CoreGetAPIVersions(int * config, int * debug, int * vidext, int * extra)
+{
+	if(config) *config = 0x020000;
+	if(debug) *debug = 0x020000;
+	if(vidext) *vidext = 0x030000;
+	if(extra) *extra = 0;
+	return M64ERR_SUCCESS;
+}
+EXPORT const char * CALL CoreErrorMessage(m64p_error) { return "stub core"; }
+EXPORT m64p_error CALL PluginStartup(m64p_dynlib_handle, void *, void (*)(void *, int, const char *)) { return M64ERR_SUCCESS; }
+EXPORT m64p_error CALL PluginShutdown(void) { return M64ERR_SUCCESS; }
+
+EXPORT m64p_error CALL CoreStartup(int, const char *, const char *, void *, ptr_DebugCallback, void * context, ptr_StateCallback callback)
+{
+	statecontext = context;
+	statecallback = callback;
+	return M64ERR_SUCCESS;
+}
+EXPORT m64p_error CALL CoreShutdown(void) { return M64ERR_SUCCESS; }
+EXPORT m64p_error CALL CoreAttachPlugin(m64p_plugin_type, m64p_dynlib_handle handle) { return romopen and handle ? M64ERR_SUCCESS : M64ERR_INVALID_STATE; }
+EXPORT m64p_error CALL CoreDetachPlugin(m64p_plugin_type) { return M64ERR_SUCCESS; }
+
+static m64p_error execute()
+{
+	stopping = false;
+	frame = 0;
+	setstate(M64EMU_RUNNING);
+	bool hang = !strncmp(romname, "HANG", 4) or !strncmp(romname, "DEAF", 4);
+	bool deaf = !strncmp(romname, "DEAF", 4);
+	while(deaf or !stopping)
+	{
+		if(hang)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		if(framecallback)
+			framecallback(frame);
+		frame++;
+	}
+	setstate(M64EMU_STOPPED);
+	return M64ERR_SUCCESS;
+}
+
+EXPORT m64p_error CALL CoreDoCommand(m64p_command command, int value, void * pointer)
+{
+	switch(command)
+	{
+	case M64CMD_ROM_OPEN:
+		if(!pointer or value < 0x40)
+			return M64ERR_INPUT_INVALID;
+		memcpy(romname, (const char *)pointer+0x20, 20);
+		romname[20] = 0;
+		romopen = true;
+		return M64ERR_SUCCESS;
+	case M64CMD_ROM_CLOSE:
+		romopen = false;
+		return M64ERR_SUCCESS;
+	case M64CMD_EXECUTE:
+		return romopen ? execute() : M64ERR_INVALID_STATE;
+	case M64CMD_STOP:
+		stopping = true;
+		return M64ERR_SUCCESS;
+	case M64CMD_SET_FRAME_CALLBACK:
+		framecallback = (m64p_frame_callback)pointer;
+		return M64ERR_SUCCESS;
+	case M64CMD_CORE_STATE_QUERY:
+		if(!pointer)
+			return M64ERR_INPUT_INVALID;
+		if(value == M64CORE_VIDEO_SIZE)
+			*(int *)pointer = width << 16 | height;
+		else
+			*(int *)pointer = 0;
+		return M64ERR_SUCCESS;
+	case M64CMD_CORE_STATE_SET:
+		return M64ERR_SUCCESS;
+	case M64CMD_READ_SCREEN:
+	{
+		if(!pointer)
+			return M64ERR_INPUT_INVALID;
+		unsigned char * pixels = (unsigned char *)pointer;
+		unsigned seed = frame;
+		for (unsigned i = 0; i < width*height*3; i++)
+			pixels[i] = (i/3+seed) * (i%3+1);
+		return M64ERR_SUCCESS;
+	}
+	default:
+		return M64ERR_UNSUPPORTED;
+	}
+}
+
+EXPORT m64p_error CALL DebugSetCallbacks(void (*)(void), void (*)(unsigned int), void (*)(void)) { return M64ERR_SUCCESS; }
+EXPORT m64p_error CALL DebugSetRunState(int) { return M64ERR_SUCCESS; }
+EXPORT int CALL DebugGetState(m64p_dbg_state) { return 0; }
+EXPORT m64p_error CALL DebugStep(void) { return M64ERR_SUCCESS; }
+EXPORT void CALL DebugDecodeOp(unsigned int, char * op, char * args, int)
+{
+	op[0] = 0;
+	args[0] = 0;
+}
+EXPORT void * CALL DebugMemGetRecompInfo(m64p_dbg_mem_info, unsigned int, int) { return NULL; }
+EXPORT int CALL DebugMemGetMemInfo(m64p_dbg_mem_info, unsigned int) { return 0; }
+EXPORT void * CALL DebugMemGetPointer(m64p_dbg_memptr_type) { return NULL; }
+EXPORT unsigned int CALL DebugMemRead32(unsigned int) { return 0; }
+EXPORT void CALL DebugMemWrite8(unsigned int, unsigned char) {}
+EXPORT void CALL DebugMemWrite32(unsigned int, unsigned int) {}
+EXPORT void * CALL DebugGetCPUDataPtr(m64p_dbg_cpu_data) { return NULL; }
+EXPORT int CALL DebugBreakpointCommand(m64p_dbg_bkp_command, unsigned int, m64p_breakpoint *) { return -1; }
+
+#endif